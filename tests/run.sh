@@ -0,0 +1,61 @@
+#!/bin/sh
+# Builds zip_write_test as C and as C++, runs it and checks every archive it writes with Info-ZIP's unzip.
+# Needs cc/c++ (or $CC/$CXX), unzip and python3 (which writes the archives the tests read from).
+set -e
+cd "$(dirname "$0")"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# archives from another writer: one seekable, one written to a pipe (with data descriptors)
+python3 - "$work/source.zip" <<'PY'
+import sys, zipfile
+text = b"".join(b"source line %d\n" % i for i in range(5000))
+with zipfile.ZipFile(sys.argv[1], "w") as z:
+    z.writestr("text.txt", text, zipfile.ZIP_DEFLATED)
+    z.writestr("dir/stored.bin", bytes(range(256)) * 64, zipfile.ZIP_STORED)
+    z.writestr("empty.txt", b"", zipfile.ZIP_DEFLATED)
+PY
+python3 -c '
+import sys, zipfile
+with zipfile.ZipFile(sys.stdout.buffer, "w") as z:
+    z.writestr("piped.txt", b"through a pipe\n" * 1000, zipfile.ZIP_DEFLATED)
+    z.writestr("piped.bin", bytes(range(256)) * 16, zipfile.ZIP_STORED)
+' | cat > "$work/streamed.zip"
+
+# what the copied entries should hold
+unzip -q "$work/source.zip" -d "$work/expect-copy"
+unzip -q "$work/streamed.zip" -d "$work/expect-streamed"
+
+flags="-O2 -g -Wall -Wextra -Werror"
+${CC:-cc} -x c $flags zip_write_test.c -o "$work/zip_write_test_c" -lpthread
+${CXX:-c++} -x c++ $flags -Wno-missing-field-initializers zip_write_test.c -o "$work/zip_write_test_cpp" -lpthread
+
+status=0
+for lang in c cpp; do
+	out="$work/out-$lang"
+	mkdir "$out"
+	if ! "$work/zip_write_test_$lang" "$out" "$work/source.zip" "$work/streamed.zip"; then
+		echo "FAIL $lang: zip_write_test"
+		status=1
+		continue
+	fi
+
+	mkdir -p "$out/copy" "$out/append-source"
+	cp -R "$work/expect-copy/." "$out/copy/"
+	cp "$work/expect-copy/text.txt" "$out/copy/renamed.txt"
+	for f in piped.txt piped.bin; do cp "$work/expect-streamed/$f" "$out/copy/streamed-$f"; done
+	cp -R "$work/expect-copy/." "$out/append-source/"
+
+	for zip in "$out"/*.zip; do
+		name=$(basename "$zip" .zip)
+		if ! unzip -tq "$zip" > "$work/log" 2>&1 || ! unzip -q "$zip" -d "$work/got-$lang-$name" ||
+		   ! diff -r "$out/$name" "$work/got-$lang-$name"; then
+			cat "$work/log"
+			echo "FAIL $lang: $name.zip"
+			status=1
+		else
+			echo "ok $lang: $name.zip"
+		fi
+	done
+done
+exit $status
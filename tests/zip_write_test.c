@@ -0,0 +1,378 @@
+// Round trips through zip_write.h. Each archive <name>.zip written to the output directory has its
+// expected contents next to it, in <name>/, for run.sh to compare with what an independent unzip extracts.
+// Usage: zip_write_test <output dir> <source.zip> <streamed.zip>
+#define ZIP_WRITE_IMPLEMENT
+#include "../zip_write.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #x); return 1; } } while (0)
+
+static const char*   out_dir;
+static char          text_path[1024];
+static char          random_path[1024];
+static unsigned char text[200000];
+static unsigned char random_bytes[300000];
+
+static const char* out_path(const char* name) {
+	static char path[4][1024];
+	static int next;
+	char* result = path[next++ & 3];
+	snprintf(result, sizeof(path[0]), "%s/%s", out_dir, name);
+	return result;
+}
+
+static int write_file(const char* path, const void* data, size_t size) {
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return 0;
+	if (fwrite(data, 1, size, file) != size) {
+		fclose(file);
+		return 0;
+	}
+	return fclose(file) == 0;
+}
+
+static int copy_file(const char* dst, const char* src) {
+	static unsigned char buffer[1 << 16];
+	size_t size;
+	FILE* in = fopen(src, "rb");
+	FILE* out = fopen(dst, "wb");
+	int ok = in && out;
+	while (ok && (size = fread(buffer, 1, sizeof(buffer), in)) > 0)
+		ok = fwrite(buffer, 1, size, out) == size;
+	if (in)
+		fclose(in);
+	if (out && fclose(out) != 0)
+		ok = 0;
+	return ok;
+}
+
+// Records what an entry of <archive>.zip should hold
+static int expect(const char* archive, const char* name, const void* data, size_t size) {
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s", out_dir, archive);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/%s/%s", out_dir, archive, name);
+	return write_file(path, data, size);
+}
+
+static int expect_text(const char* archive, const char* name, const char* data) {
+	return expect(archive, name, data, strlen(data));
+}
+
+// The same mix of entries for every output path: whole files (stored and deflated), data written in
+// pieces, many small entries and a buffer large enough to go through several output buffers at once
+static int add_mix(zw_zip archive, const char* expected, int small_entries) {
+	size_t offset;
+	int i;
+
+	CHECK(zw_add_file(archive, "random.bin", random_path, zw_method_store));
+	CHECK(zw_add_file(archive, "text.txt", text_path, zw_method_deflate));
+	CHECK(zw_begin_file(archive, "pieces.txt"));
+	for (offset = 0; offset < sizeof(text); offset += 1000)
+		CHECK(zw_write(archive, text + offset, sizeof(text) - offset < 1000 ? sizeof(text) - offset : 1000));
+	for (i = 0; i < small_entries; ++i) {
+		char name[32], data[32];
+		snprintf(name, sizeof(name), "small-%d.txt", i);
+		snprintf(data, sizeof(data), "entry %d", i);
+		CHECK(zw_begin_file(archive, name));
+		CHECK(zw_write_text(archive, data));
+		CHECK(expect_text(expected, name, data));
+	}
+	CHECK(zw_add_data(archive, "random-data.bin", random_bytes, sizeof(random_bytes)));
+
+	CHECK(expect(expected, "random.bin", random_bytes, sizeof(random_bytes)));
+	CHECK(expect(expected, "text.txt", text, sizeof(text)));
+	CHECK(expect(expected, "pieces.txt", text, sizeof(text)));
+	CHECK(expect(expected, "random-data.bin", random_bytes, sizeof(random_bytes)));
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////
+
+typedef struct test_sink {
+	FILE*               file;
+	size_t              limit;          // > 0: fail the write that would go past this many bytes
+	size_t              total;
+	unsigned            seed;           // > 0: take a random part of each write, often nothing
+	int                 calls;
+	int                 partial;
+	int                 closed;
+} test_sink;
+
+static size_t sink_write(zw_output_stream* stream, const void* data, size_t size) {
+	test_sink* sink = (test_sink*)stream->user_data;
+	size_t take = size;
+
+	if (sink->seed) {
+		sink->seed = sink->seed * 1103515245u + 12345u;
+		take = (sink->seed >> 8) % 4 == 0 ? 0 : (sink->seed >> 4) % (size + 1);
+		if (take < size)
+			++sink->partial;
+	}
+	if (sink->limit && sink->total + take > sink->limit) {
+		stream->error = 7;
+		return 0;
+	}
+	// now and then, leave the other side waiting
+	if (++sink->calls % 7 == 0)
+		usleep(100);
+	sink->total += take;
+	return fwrite(data, 1, take, sink->file);
+}
+
+static void sink_close(zw_output_stream* stream) {
+	test_sink* sink = (test_sink*)stream->user_data;
+	if (sink->file)
+		fclose(sink->file);
+	sink->closed = 1;
+}
+
+static zw_zip create_on_sink(zw_zip_options* options, test_sink* sink, const char* path) {
+	sink->file = fopen(path, "wb");
+	if (!sink->file)
+		return NULL;
+	options->stream.user_data = sink;
+	options->stream.write = sink_write;
+	options->stream.close = sink_close;
+	return zw_create_ex(options);
+}
+
+////////////////////////////////////////////////////////////////
+
+// a writer thread drains the output buffers while the archive fills the next ones
+static int test_pipeline(void) {
+	zw_zip_options options;
+	test_sink sink;
+	zw_zip archive;
+	int i;
+
+	// a custom stream, with small buffers so producer and writer keep waiting on each other
+	memset(&options, 0, sizeof(options));
+	memset(&sink, 0, sizeof(sink));
+	options.pipeline_buffers = 3;
+	options.output_buffer_size = 2048;
+	archive = create_on_sink(&options, &sink, out_path("pipeline-stream.zip"));
+	CHECK(archive);
+	CHECK(add_mix(archive, "pipeline-stream", 300) == 0);
+	CHECK(zw_flush(archive, zw_flush_sync));
+	CHECK(zw_finish(archive));
+	CHECK(sink.closed);
+
+	// a file
+	memset(&options, 0, sizeof(options));
+	options.file_path = out_path("pipeline-file.zip");
+	options.pipeline_buffers = 4;
+	archive = zw_create_ex(&options);
+	CHECK(archive);
+	CHECK(add_mix(archive, "pipeline-file", 300) == 0);
+	CHECK(zw_finish(archive));
+
+	// errors on the writer thread come back through zw_finish
+	memset(&options, 0, sizeof(options));
+	memset(&sink, 0, sizeof(sink));
+	sink.limit = 100000;
+	options.pipeline_buffers = 2;
+	options.output_buffer_size = 4096;
+	archive = create_on_sink(&options, &sink, out_path("pipeline-error.bin"));
+	CHECK(archive);
+	for (i = 0; i < 100 && zw_add_data(archive, "random-data.bin", random_bytes, sizeof(random_bytes)); ++i)
+		;
+	CHECK(i < 100);
+	CHECK(!zw_finish(archive));
+	CHECK(sink.closed);
+	return 0;
+}
+
+// with io_uring (or the writer thread standing in for it) buffers belong to the kernel until
+// their writes complete; reusing one early shows up as corrupt data
+static int test_async(void) {
+	static const char* names[] = { "async-2", "async-4", "async-small" };
+	int pass;
+
+	for (pass = 0; pass < 3; ++pass) {
+		zw_zip_options options;
+		zw_zip archive;
+		char file_name[64];
+
+		snprintf(file_name, sizeof(file_name), "%s.zip", names[pass]);
+		memset(&options, 0, sizeof(options));
+		options.file_path = out_path(file_name);
+		options.async_buffers = pass == 0 ? 2 : 4;
+		options.output_buffer_size = pass == 2 ? 4096 : 0;
+		options.sync_writeback = pass == 1 ? zw_true : zw_false;
+		archive = zw_create_ex(&options);
+		CHECK(archive);
+		CHECK(add_mix(archive, names[pass], 500) == 0);
+		CHECK(zw_finish(archive));
+	}
+	return 0;
+}
+
+// a stream that takes only part of each write; every call that would block is repeated
+#define RETRY(call) do { int tries_ = 0; while (!(call)) { CHECK(zw_would_block(archive) && ++tries_ < 100000); } } while (0)
+
+static int test_non_blocking(void) {
+	zw_zip_options options;
+	test_sink sink;
+	zw_zip archive;
+	size_t offset;
+	int i, tries;
+
+	memset(&options, 0, sizeof(options));
+	memset(&sink, 0, sizeof(sink));
+	sink.seed = 1;
+	options.non_blocking = zw_true;
+	options.output_buffer_size = 1024;
+	archive = create_on_sink(&options, &sink, out_path("non-blocking.zip"));
+	CHECK(archive);
+	RETRY(zw_add_file(archive, "random.bin", random_path, zw_method_store));
+	RETRY(zw_add_file(archive, "text.txt", text_path, zw_method_deflate));
+	RETRY(zw_begin_file(archive, "pieces.txt"));
+	for (offset = 0; offset < sizeof(text); offset += 1000)
+		RETRY(zw_write(archive, text + offset, sizeof(text) - offset < 1000 ? sizeof(text) - offset : 1000));
+	for (i = 0; i < 200; ++i) {
+		char name[32];
+		snprintf(name, sizeof(name), "small-%d.txt", i);
+		RETRY(zw_begin_file(archive, name));
+		RETRY(zw_write_text(archive, name));
+		CHECK(expect_text("non-blocking", name, name));
+	}
+	RETRY(zw_add_data(archive, "random-data.bin", random_bytes, sizeof(random_bytes)));
+	for (tries = 0; !zw_finish(archive); ++tries)
+		CHECK(zw_would_block(archive) && tries < 100000);
+	CHECK(sink.closed);
+	CHECK(sink.partial > 0);
+
+	CHECK(expect("non-blocking", "random.bin", random_bytes, sizeof(random_bytes)));
+	CHECK(expect("non-blocking", "text.txt", text, sizeof(text)));
+	CHECK(expect("non-blocking", "pieces.txt", text, sizeof(text)));
+	CHECK(expect("non-blocking", "random-data.bin", random_bytes, sizeof(random_bytes)));
+
+	// a failed write ends it: zw_finish reports the failure, however often it was resumed
+	memset(&options, 0, sizeof(options));
+	memset(&sink, 0, sizeof(sink));
+	sink.seed = 5;
+	sink.limit = 200000;
+	options.non_blocking = zw_true;
+	options.output_buffer_size = 1024;
+	archive = create_on_sink(&options, &sink, out_path("non-blocking-error.bin"));
+	CHECK(archive);
+	for (i = 0; i < 2000 && (zw_add_data(archive, "random-data.bin", random_bytes, sizeof(random_bytes)) ||
+	                         zw_would_block(archive)); ++i)
+		;
+	for (tries = 0; !sink.closed; ++tries) {
+		CHECK(!zw_finish(archive));
+		CHECK(tries < 100000);
+	}
+	return 0;
+}
+
+// entries of archives written by another tool are copied over as they are
+static int test_copy(const char* source_path, const char* streamed_path) {
+	zw_source source = zw_source_open(source_path);
+	zw_source streamed = zw_source_open(streamed_path);
+	zw_zip archive;
+	size_t i;
+
+	CHECK(source && streamed);
+	CHECK(zw_source_count(source) > 0 && zw_source_count(streamed) > 0);
+	CHECK(zw_source_find(source, "missing.txt") == (size_t)-1);
+
+	archive = zw_create(out_path("copy.zip"));
+	CHECK(archive);
+	CHECK(zw_begin_file(archive, "new.txt"));
+	CHECK(zw_write_text(archive, "written, not copied"));
+	CHECK(expect_text("copy", "new.txt", "written, not copied"));
+	for (i = 0; i < zw_source_count(source); ++i)
+		CHECK(zw_copy_entry(archive, source, i, NULL));
+	CHECK(zw_copy_entry(archive, source, zw_source_find(source, "text.txt"), "renamed.txt"));
+	// written to a pipe, so with data descriptors instead of sizes in the local headers
+	for (i = 0; i < zw_source_count(streamed); ++i) {
+		char name[1024];
+		snprintf(name, sizeof(name), "streamed-%s", zw_source_name(streamed, i));
+		CHECK(zw_copy_entry(archive, streamed, i, name));
+	}
+	CHECK(zw_finish(archive));
+	zw_source_close(source);
+	zw_source_close(streamed);
+	return 0;
+}
+
+// new entries go after the existing ones, replacing the old central directory
+static int test_append(const char* source_path) {
+	zw_zip archive;
+
+	archive = zw_create(out_path("append.zip"));
+	CHECK(archive);
+	CHECK(zw_begin_file(archive, "first.txt"));
+	CHECK(zw_write_text(archive, "from the first run"));
+	CHECK(zw_finish(archive));
+	CHECK(expect_text("append", "first.txt", "from the first run"));
+
+	archive = zw_open_append(out_path("append.zip"));
+	CHECK(archive);
+	CHECK(zw_begin_file(archive, "second.txt"));
+	CHECK(zw_write_text(archive, "from the second run"));
+	CHECK(zw_add_file(archive, "text.txt", text_path, zw_method_deflate));
+	CHECK(zw_finish(archive));
+	CHECK(expect_text("append", "second.txt", "from the second run"));
+	CHECK(expect("append", "text.txt", text, sizeof(text)));
+
+	// nothing appended: the archive stays as it was
+	archive = zw_open_append(out_path("append.zip"));
+	CHECK(archive);
+	CHECK(zw_finish(archive));
+
+	// another tool's archive
+	CHECK(copy_file(out_path("append-source.zip"), source_path));
+	archive = zw_open_append(out_path("append-source.zip"));
+	CHECK(archive);
+	CHECK(zw_add_data(archive, "appended.bin", random_bytes, 1000));
+	CHECK(zw_finish(archive));
+	CHECK(expect("append-source", "appended.bin", random_bytes, 1000));
+
+	CHECK(zw_open_append(out_path("missing.zip")) == NULL);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	unsigned seed = 12345;
+	size_t i, length;
+	int failed = 0;
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s <output dir> <source.zip> <streamed.zip>\n", argv[0]);
+		return 2;
+	}
+	out_dir = argv[1];
+
+	for (i = 0; i < sizeof(text); i += length) {
+		char line[64];
+		length = (size_t)snprintf(line, sizeof(line), "line %u of the text, word %u\n", (unsigned)(i / 40), (unsigned)(i % 97));
+		if (length > sizeof(text) - i)
+			length = sizeof(text) - i;
+		memcpy(text + i, line, length);
+	}
+	for (i = 0; i < sizeof(random_bytes); ++i) {
+		seed = seed * 1103515245u + 12345u;
+		random_bytes[i] = (unsigned char)(seed >> 16);
+	}
+	snprintf(text_path, sizeof(text_path), "%s/text.txt", out_dir);
+	snprintf(random_path, sizeof(random_path), "%s/random.bin", out_dir);
+	if (!write_file(text_path, text, sizeof(text)) || !write_file(random_path, random_bytes, sizeof(random_bytes))) {
+		fprintf(stderr, "can't write to %s\n", out_dir);
+		return 2;
+	}
+
+	failed |= test_pipeline();
+	failed |= test_async();
+	failed |= test_non_blocking();
+	failed |= test_copy(argv[2], argv[3]);
+	failed |= test_append(argv[2]);
+	return failed;
+}
@@ -17,8 +17,16 @@ BUILDING:
 	in the file that you want to have the implementation.
 
 	You can #define ZW_ASSERT(x) before the #include to avoid using assert.h.
-	You can #define ZW_MALLOC(), ZW_REALLOC(), and ZW_FREE() to replace malloc, realloc, free.
+	You can #define ZW_MALLOC(), ZW_REALLOC(), and ZW_FREE() to replace malloc, realloc, free
+	(or set zw_zip_options::allocator at runtime).
 	You can #define ZW_MEMMOVE() to replace memmove.
+	You can #define ZW_NO_POSIX to disable the POSIX-specific code paths (mmap, fd copies).
+	Strict C modes (-std=c99) hide POSIX, so those paths need _POSIX_C_SOURCE=200809L defined before any
+	#include; the Linux extras (zero copy, io_uring, sync_file_range) also need _GNU_SOURCE or _DEFAULT_SOURCE.
+	Without them, the portable stdio code is used.
+	You can #define ZW_NO_ZERO_COPY to disable copy_file_range/sendfile on Linux.
+	You can #define ZW_NO_IO_URING to disable the io_uring output path on Linux.
+	You can #define ZW_NO_THREADS to disable everything that needs threads (link with -lpthread otherwise).
 
 USAGE:
 	// [main.c]
@@ -29,6 +37,7 @@ USAGE:
 		zw_zip archive = zw_create("envelope.zip");
 		zw_begin_file(archive, "letter.txt");
 		zw_write_text(archive, "hello, world!");
+		zw_add_file(archive, "photo.jpg", "/tmp/photo.jpg", zw_method_store);
 		return zw_finish(archive) ? 0 : 1;
 	}
 
@@ -39,31 +48,186 @@ LICENSE:
 #define ZIP_WRITE_H_INCLUDED
 
 #include <stddef.h>	// size_t
+#include <stdarg.h>	// va_list
 
 #ifdef __cplusplus
 extern "C" {
 #endif // def __cplusplus
 
 typedef enum { zw_false, zw_true, } zw_bool;
+typedef enum { zw_method_store = 0, zw_method_deflate = 8, } zw_method;
+typedef enum { zw_flush_sync, zw_flush_full, } zw_flush_mode;
 typedef struct zw_zip_options zw_zip_options;
+typedef struct zw_entry zw_entry;
 typedef struct zw__zip_details* zw_zip;
 
+// Fills buffer with up to capacity bytes of an entry's data: returns how many, 0 at the end or (size_t)-1 on failure
+typedef size_t (*zw_read_func)(void* user_data, void* buffer, size_t capacity);
+
+#if defined(__GNUC__)
+	#define ZW__PRINTF_FORMAT(format_index, first_arg) __attribute__((format(printf, format_index, first_arg)))
+#else
+	#define ZW__PRINTF_FORMAT(format_index, first_arg)
+#endif
+typedef struct zw__source_details* zw_source;
+typedef struct zw__deflate_details* zw_deflate;
+typedef enum { zw_deflate_raw, zw_deflate_zlib, zw_deflate_gzip, } zw_deflate_format;
+typedef struct zw_gzip_options zw_gzip_options;
+typedef struct zw__gzip_details* zw_gzip;
+
 zw_zip                  zw_create(const char* file_path);
 zw_zip                  zw_create_ex(const zw_zip_options* options);
+zw_zip                  zw_open_append(const char* file_path);
 zw_bool                 zw_begin_file(zw_zip archive, const char* file_path);
+zw_bool                 zw_begin_file_raw(zw_zip archive, const char* file_path, zw_method method, unsigned crc,
+                                          unsigned long long compressed_size, unsigned long long uncompressed_size);
 zw_bool                 zw_write(zw_zip archive, const void* data, size_t data_len);
 zw_bool                 zw_write_text(zw_zip archive, const char* text);
+zw_bool                 zw_putc(zw_zip archive, int c);
+zw_bool                 zw_write_u32(zw_zip archive, unsigned value);             // little endian
+zw_bool                 zw_write_u64(zw_zip archive, unsigned long long value);   // little endian
+zw_bool                 zw_printf(zw_zip archive, const char* format, ...) ZW__PRINTF_FORMAT(2, 3);
+zw_bool                 zw_vprintf(zw_zip archive, const char* format, va_list args);
+zw_bool                 zw_flush(zw_zip archive, zw_flush_mode mode);
+zw_bool                 zw_add_file(zw_zip archive, const char* file_path, const char* source_path, zw_method method);
+zw_bool                 zw_add_data(zw_zip archive, const char* file_path, const void* data, size_t data_len);
+zw_bool                 zw_add_entries(zw_zip archive, const zw_entry* entries, size_t count);  // many zw_add_data calls in one
+zw_bool                 zw_add_stream(zw_zip archive, const char* file_path, zw_read_func read, void* user_data);
 zw_bool                 zw_finish(zw_zip archive);
+zw_bool                 zw_would_block(zw_zip archive);     // non-blocking streams: output is waiting for the stream
+
+// Reusable archives (zw_zip_options::reusable) are kept by zw_finish, so the next one can start in the same memory
+zw_bool                 zw_reset(zw_zip archive, const zw_zip_options* options);
+void                    zw_release(zw_zip archive);
+
+// Finished archives are kept in a per-thread pool (up to max_bytes, 0 by default) for zw_create_ex to reuse.
+// Each thread that enabled its pool empties it with zw_pool_limit(0) before exiting.
+void                    zw_pool_limit(size_t max_bytes);
+
+// Existing archives, for copying entries without recompressing them
+zw_source               zw_source_open(const char* file_path);
+size_t                  zw_source_count(zw_source source);
+const char*             zw_source_name(zw_source source, size_t index);
+size_t                  zw_source_find(zw_source source, const char* file_path);  // (size_t)-1 if not found
+zw_bool                 zw_copy_entry(zw_zip archive, zw_source source, size_t index, const char* file_path);
+void                    zw_source_close(zw_source source);
+
+// Sizes are always passed back, so allocators don't need to track them
+typedef struct zw_allocator {
+	void*               user_data;
+	void*               (*allocate)(void* user_data, size_t size);
+	void*               (*reallocate)(void* user_data, void* ptr, size_t old_size, size_t new_size);
+	void                (*deallocate)(void* user_data, void* ptr, size_t size);
+} zw_allocator;
+
+typedef struct zw_iovec {
+	const void*         data;
+	size_t              size;
+} zw_iovec;
+
+struct zw_entry {
+	const char*         file_path;
+	const void*         data;
+	size_t              size;
+};
 
 typedef struct zw_output_stream {
 	void*               user_data;
 	size_t              (*write)(struct zw_output_stream* stream, const void* buf, size_t size);
 	void                (*close)(struct zw_output_stream* stream);
 	int                 error;
+
+	// optional: copies size bytes starting at offset in src_fd directly to the output,
+	// returning the number of bytes copied (any remainder goes through write)
+	size_t              (*copy_fd)(struct zw_output_stream* stream, int src_fd, unsigned long long offset, size_t size);
+
+	// optional: gathered write, returns the total number of bytes written
+	size_t              (*writev)(struct zw_output_stream* stream, const zw_iovec* iov, int count);
+
+	// optional: asynchronous write of a full output buffer. The stream takes ownership of buf and returns
+	// another buffer of the same capacity to continue with. On failure it returns NULL *without* taking buf.
+	// Errors from the write itself are reported later, through error; close must wait for pending writes.
+	void*               (*submit)(struct zw_output_stream* stream, void* buf, size_t size, size_t capacity);
+
+	// optional: called by zw_flush after all buffered output was handed to the stream
+	void                (*flush)(struct zw_output_stream* stream);
 } zw_output_stream;
 
 struct zw_zip_options {
 	zw_output_stream   stream;
+	const char*        file_path;       // opened with stdio when stream.write is NULL
+	const char*        cache_dir;       // optional: reuse compressed data for identical content across runs
+	                                    // (matched on size, crc32 and a 64-bit hash, not the content itself, and
+	                                    // copied in unchecked: only use a directory nothing untrusted can write to)
+	size_t             output_buffer_size;  // 0 for the default (256 KB); larger buffers mean fewer stream writes
+
+	// only used for file_path outputs, which are written straight to the file descriptor on POSIX
+	unsigned long long expected_size;       // preallocates the file (trimmed to the actual size on close)
+	zw_bool            sync_writeback;      // pushes written data to disk as it goes, keeping dirty pages bounded
+	                                        // (a hint: only 64-bit Linux has it, elsewhere it's ignored)
+	int                async_buffers;       // output buffers kept in flight (io_uring on Linux, else a writer thread), 0 to write synchronously
+
+	// > 0: a background thread drains up to this many filled output buffers into the stream,
+	// so compression and I/O overlap on any platform (also the fallback when io_uring is unavailable)
+	int                pipeline_buffers;
+
+	// stream.write may take fewer bytes than it is given (e.g. on EAGAIN) without that being an error.
+	// The rest is kept, and while it is waiting the archive takes no new work: calls return zw_false
+	// with zw_would_block() set, having done nothing, and should be repeated once the stream is writable.
+	// zw_finish then keeps the archive alive too; it is only released once zw_finish returns zw_true,
+	// or zw_false for any reason other than the stream blocking (e.g. a failed write, or a spilled central
+	// directory it couldn't read back). Whole-entry calls (zw_add_file, zw_copy_entry) buffer what the stream won't take.
+	zw_bool            non_blocking;
+
+	// optional: where the archive's memory comes from (ZW_MALLOC and friends if allocate is NULL)
+	zw_allocator       allocator;
+	// > 0: the archive's many small allocations (hash chains, central directory, names) are carved
+	// out of blocks of this size, which zw_finish (zw_release if reusable) releases all at once
+	size_t             arena_block_size;
+
+	// zw_finish closes the stream but keeps the archive's memory (buffers, hash chains, central directory).
+	// zw_reset then starts a new archive in it, with nothing to allocate or clear; zw_release frees it.
+	// The allocator, arena, memory profile and output buffer capacity stay those the archive was created with.
+	zw_bool            reusable;
+
+	// Trades compression for a fixed footprint: a 4K-entry hash table of short 16-bit chains, 8 KB input
+	// batches and a 4 KB output buffer (unless output_buffer_size says otherwise). An archive then needs
+	// about 120 KB, all allocated by zw_create_ex; only the central directory grows, by ~80 bytes plus the
+	// name per entry (and, for non-blocking streams, whatever output the stream doesn't take).
+	zw_bool            low_memory;
+
+	// Linux: maps the archive's window, hash table and output buffer directly, in 2 MB pages where
+	// transparent huge pages are enabled, to cut TLB misses on hash lookups. Rounds the block up to 2 MB
+	// and bypasses the allocator for it; ignored with low_memory.
+	zw_bool            huge_pages;
+
+	// > 0: central directory records past this many bytes are moved to a temporary file (tmpfile) and
+	// streamed back out by zw_finish, so memory stays flat however many entries there are
+	size_t             central_dir_memory;
+
+	// > 0: zw_add_data and zw_add_entries entries of at most this many bytes (capped at 16 KB) skip the
+	// hash chains. They get one greedy pass with a small hash table of their own, and are stored instead
+	// when that doesn't make them smaller. Their sizes go in the local header, so they need no data descriptor.
+	size_t             tiny_entry_size;
+};
+
+// Standalone deflate streams (raw, zlib or gzip framing), using the same compressor as ZIP entries.
+// Only stream.write, stream.flush and stream.close are used; zw_deflate_finish closes the stream and frees the context.
+zw_deflate              zw_deflate_create(zw_deflate_format format, const zw_output_stream* stream);
+zw_bool                 zw_deflate_write(zw_deflate deflate, const void* data, size_t data_len);
+zw_bool                 zw_deflate_flush(zw_deflate deflate, zw_flush_mode mode);
+zw_bool                 zw_deflate_finish(zw_deflate deflate);
+
+// Parallel gzip: the input is cut into independent gzip members, compressed on several threads and
+// written out in order. Any gunzip reads the result as one stream. The stream is used as for zw_deflate.
+zw_gzip                 zw_gzip_create(const zw_gzip_options* options);
+zw_bool                 zw_gzip_write(zw_gzip gzip, const void* data, size_t data_len);
+zw_bool                 zw_gzip_finish(zw_gzip gzip);
+
+struct zw_gzip_options {
+	zw_output_stream   stream;
+	int                threads;             // compression threads, 0 for one per CPU
+	size_t             member_size;         // uncompressed bytes per member, 0 for the default (1 MB)
 };
 
 #ifdef __cplusplus
@@ -83,6 +247,48 @@ struct zw_zip_options {
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdio.h>
+
+// the feature test macros are set up by now (stdio.h), non-strict modes get POSIX by default
+#if !defined(ZW_NO_POSIX) && (defined(__unix__) || defined(__APPLE__)) && \
+	(defined(__APPLE__) || !defined(__STRICT_ANSI__) || defined(_POSIX_C_SOURCE) || defined(_XOPEN_SOURCE))
+	#define ZW__POSIX
+	#include <errno.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <sys/uio.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+// syscall() and the other Linux extensions are only declared for _DEFAULT_SOURCE (the default outside strict modes)
+#if defined(ZW__POSIX) && defined(__linux__) && (defined(_DEFAULT_SOURCE) || defined(_BSD_SOURCE) || defined(_GNU_SOURCE))
+	#define ZW__LINUX
+	#include <sys/syscall.h>
+#endif
+
+#if defined(ZW__LINUX) && !defined(ZW_NO_ZERO_COPY)
+	#define ZW__ZERO_COPY
+	#include <sys/sendfile.h>
+#endif
+
+// sync_file_range goes through syscall(), like copy_file_range, so it doesn't need _GNU_SOURCE.
+// 32-bit ABIs split its 64-bit arguments, so it's left to 64-bit ones.
+#if defined(ZW__LINUX) && (defined(SYS_sync_file_range) || defined(SYS_sync_file_range2)) && defined(__LP64__)
+	#define ZW__SYNC_WRITEBACK
+#endif
+
+#if defined(ZW__LINUX) && defined(MADV_HUGEPAGE) && defined(MAP_ANONYMOUS)
+	#define ZW__HUGE_PAGES
+#endif
+
+#if defined(ZW__LINUX) && !defined(ZW_NO_IO_URING) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define ZW__IO_URING
+		#include <linux/io_uring.h>
+	#endif
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -113,6 +319,34 @@ extern "C" {
 #define ZW_MEMMOVE(a,b,sz)     memmove(a,b,sz)
 #endif
 
+#if !defined(ZW_NO_THREADS) && (defined(__GNUC__) || defined(_MSC_VER))
+	#if defined(_WIN32)
+		#define ZW__THREADS
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+			#define ZW__LEAN_AND_MEAN
+		#endif
+		#include <windows.h>
+		#ifdef ZW__LEAN_AND_MEAN
+			#undef WIN32_LEAN_AND_MEAN
+			#undef ZW__LEAN_AND_MEAN
+		#endif
+		#if defined(_MSC_VER) && (defined(_M_ARM64) || defined(_M_ARM64EC))
+			#include <intrin.h>
+		#endif
+	#elif defined(ZW__POSIX)
+		#define ZW__THREADS
+		#include <pthread.h>
+	#endif
+#endif
+
+// for the context pool, which has to be per thread whether or not the library starts any itself
+#if defined(_MSC_VER)
+	#define ZW__THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+	#define ZW__THREAD_LOCAL __thread
+#endif
+
 ////////////////////////////////////////////////////////////////
 
 #define ZW_CONCAT2(a, b) a ## b
@@ -201,6 +435,117 @@ ZW_STATIC_ASSERT(sizeof(zw_u64) == 8);
 	}
 #endif // def ZW_NO_BSF
 
+////////////////////////////////////////////////////////////////
+// Threads and atomics (just enough for handing buffers between two threads)
+////////////////////////////////////////////////////////////////
+
+#ifdef ZW__THREADS
+
+#ifdef _WIN32
+	typedef HANDLE                  zw__thread;
+	typedef CRITICAL_SECTION        zw__mutex;
+	typedef CONDITION_VARIABLE      zw__cond;
+
+	#define ZW__THREAD_PROC(name)   static DWORD WINAPI name(LPVOID arg)
+	#define ZW__THREAD_RETURN       return 0
+
+	static zw_bool zw__thread_start(zw__thread* thread, LPTHREAD_START_ROUTINE proc, void* arg) {
+		*thread = CreateThread(NULL, 0, proc, arg, 0, NULL);
+		return *thread ? zw_true : zw_false;
+	}
+	static void zw__thread_join(zw__thread thread)  { WaitForSingleObject(thread, INFINITE); CloseHandle(thread); }
+	static void zw__mutex_init(zw__mutex* mutex)    { InitializeCriticalSection(mutex); }
+	static void zw__mutex_destroy(zw__mutex* mutex) { DeleteCriticalSection(mutex); }
+	static void zw__mutex_lock(zw__mutex* mutex)    { EnterCriticalSection(mutex); }
+	static void zw__mutex_unlock(zw__mutex* mutex)  { LeaveCriticalSection(mutex); }
+	static void zw__cond_init(zw__cond* cond)       { InitializeConditionVariable(cond); }
+	static void zw__cond_destroy(zw__cond* cond)    { (void)cond; }
+	static void zw__cond_wait(zw__cond* cond, zw__mutex* mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+	static void zw__cond_signal(zw__cond* cond)     { WakeConditionVariable(cond); }
+	static void zw__cond_broadcast(zw__cond* cond)  { WakeAllConditionVariable(cond); }
+#else
+	typedef pthread_t               zw__thread;
+	typedef pthread_mutex_t         zw__mutex;
+	typedef pthread_cond_t          zw__cond;
+
+	#define ZW__THREAD_PROC(name)   static void* name(void* arg)
+	#define ZW__THREAD_RETURN       return NULL
+
+	static zw_bool zw__thread_start(zw__thread* thread, void* (*proc)(void*), void* arg) {
+		return pthread_create(thread, NULL, proc, arg) == 0 ? zw_true : zw_false;
+	}
+	static void zw__thread_join(zw__thread thread)  { pthread_join(thread, NULL); }
+	static void zw__mutex_init(zw__mutex* mutex)    { pthread_mutex_init(mutex, NULL); }
+	static void zw__mutex_destroy(zw__mutex* mutex) { pthread_mutex_destroy(mutex); }
+	static void zw__mutex_lock(zw__mutex* mutex)    { pthread_mutex_lock(mutex); }
+	static void zw__mutex_unlock(zw__mutex* mutex)  { pthread_mutex_unlock(mutex); }
+	static void zw__cond_init(zw__cond* cond)       { pthread_cond_init(cond, NULL); }
+	static void zw__cond_destroy(zw__cond* cond)    { pthread_cond_destroy(cond); }
+	static void zw__cond_wait(zw__cond* cond, zw__mutex* mutex) { pthread_cond_wait(cond, mutex); }
+	static void zw__cond_signal(zw__cond* cond)     { pthread_cond_signal(cond); }
+	static void zw__cond_broadcast(zw__cond* cond)  { pthread_cond_broadcast(cond); }
+#endif // def _WIN32
+
+// On x86 every load acquires and every store releases, so MSVC only has to keep the compiler from
+// reordering; elsewhere it needs the real instructions.
+static ZW_INLINE unsigned zw__load_acquire(const unsigned* ptr) {
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64)) && !defined(_M_ARM64EC)
+	unsigned value = *(const volatile unsigned*)ptr;
+	_ReadWriteBarrier();
+	return value;
+#elif defined(_MSC_VER) && (defined(_M_ARM64) || defined(_M_ARM64EC))
+	return __ldar32((unsigned __int32 volatile*)ptr);
+#elif defined(_MSC_VER)
+	return (unsigned)InterlockedCompareExchange((volatile LONG*)ptr, 0, 0);
+#else
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static ZW_INLINE void zw__store_release(unsigned* ptr, unsigned value) {
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64)) && !defined(_M_ARM64EC)
+	_ReadWriteBarrier();
+	*(volatile unsigned*)ptr = value;
+#elif defined(_MSC_VER) && (defined(_M_ARM64) || defined(_M_ARM64EC))
+	__stlr32((unsigned __int32 volatile*)ptr, value);
+#elif defined(_MSC_VER)
+	InterlockedExchange((volatile LONG*)ptr, (LONG)value);
+#else
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+// Sequentially consistent: unlike acquire/release, a store followed by a load of another variable
+// can't be reordered, which is what two threads need to agree on whether one of them went to sleep
+static ZW_INLINE void zw__store_seq_cst(unsigned* ptr, unsigned value) {
+#ifdef _MSC_VER
+	InterlockedExchange((volatile LONG*)ptr, (LONG)value);
+#else
+	__atomic_store_n(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static ZW_INLINE unsigned zw__load_seq_cst(const unsigned* ptr) {
+#ifdef _MSC_VER
+	return zw__load_acquire(ptr);  // the stores it pairs with are full barriers
+#else
+	return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static int zw__cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
+}
+
+#endif // def ZW__THREADS
+
 ////////////////////////////////////////////////////////////////
 
 static zw_u32 zw__crc32(const zw_u8* buffer, size_t len, zw_u32 initial) {
@@ -247,6 +592,179 @@ static zw_u32 zw__crc32(const zw_u8* buffer, size_t len, zw_u32 initial) {
 	return ~crc;
 }
 
+static zw_u32 zw__adler32(const zw_u8* buffer, size_t len, zw_u32 adler) {
+	zw_u32 a = adler & 0xffff, b = adler >> 16;
+
+	while (len > 0) {
+		// largest n such that the sums can't overflow before the modulo
+		size_t n = len < 5552 ? len : 5552;
+		len -= n;
+		while (n--) {
+			a += *buffer++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+
+	return (b << 16) | a;
+}
+
+// Content hash, used for cache keys. When hashing in several steps (feeding back the previous result),
+// all but the last chunk must be multiples of 8 bytes long. Finish with zw__hash64_final.
+static zw_u64 zw__hash64(const zw_u8* data, size_t len, zw_u64 hash) {
+	zw_u64 word;
+	size_t i;
+
+	for (i = 0; i < len; i += 8) {
+		word = 0;
+		memcpy(&word, data + i, len - i < 8 ? len - i : 8);
+		hash = (hash ^ (word * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull;
+		hash ^= hash >> 29;
+	}
+
+	return hash;
+}
+
+static zw_u64 zw__hash64_final(zw_u64 hash, zw_u64 total_len) {
+	hash ^= total_len;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+#define ZW_FOURCC(a, b, c, d)       (((a)) | ((b)<<8) | ((c)<<16) | ((d)<<24))
+#define ZW_ROUND_UP(x, pow2)        (((x)+((pow2)-1)) & ~((pow2)-1))
+
+////////////////////////////////////////////////////////////////
+// Allocators
+////////////////////////////////////////////////////////////////
+
+#define zw__alloc(al, size)         (al)->allocate((al)->user_data, (size))
+#define zw__free(al, ptr, size)     (al)->deallocate((al)->user_data, (ptr), (size))
+
+static void* zw__default_allocate(void* user_data, size_t size) {
+	(void)user_data;
+	return ZW_MALLOC(size);
+}
+
+static void* zw__default_reallocate(void* user_data, void* ptr, size_t old_size, size_t new_size) {
+	(void)user_data;
+	(void)old_size;
+	return ZW_REALLOC_SIZED(ptr, old_size, new_size);
+}
+
+static void zw__default_deallocate(void* user_data, void* ptr, size_t size) {
+	(void)user_data;
+	(void)size;
+	ZW_FREE(ptr);
+}
+
+static const zw_allocator zw__default_allocator = {
+	NULL, &zw__default_allocate, &zw__default_reallocate, &zw__default_deallocate,
+};
+
+static zw_allocator zw__options_allocator(const zw_allocator* allocator) {
+	return allocator && allocator->allocate ? *allocator : zw__default_allocator;
+}
+
+// Arena: bump allocation out of large blocks, all released together. Only the most recent
+// allocation can grow or shrink in place; anything else that is freed stays put until the end.
+
+typedef struct zw__arena_block {
+	struct zw__arena_block* next;
+	size_t              size;           // usable bytes, following the (16-byte) header
+	size_t              used;
+} zw__arena_block;
+
+typedef struct {
+	zw_allocator        base;           // where the blocks come from
+	size_t              block_size;
+	zw__arena_block*    blocks;         // current block first
+	zw_u8*              last;           // most recent allocation
+	size_t              last_size;
+} zw__arena;
+
+enum {
+	zw__arena_header_bytes = ZW_ROUND_UP(sizeof(zw__arena_block), 16),
+};
+
+static void* zw__arena_allocate(void* user_data, size_t size) {
+	zw__arena* arena = (zw__arena*)user_data;
+	zw__arena_block* block = arena->blocks;
+	zw_u8* ptr;
+
+	size = ZW_ROUND_UP(size, 16);
+	if (!block || block->size - block->used < size) {
+		size_t block_size = size > arena->block_size ? size : arena->block_size;
+		block = (zw__arena_block*) zw__alloc(&arena->base, zw__arena_header_bytes + block_size);
+		if (!block)
+			return NULL;
+		block->next = arena->blocks;
+		block->size = block_size;
+		block->used = 0;
+		arena->blocks = block;
+	}
+
+	ptr = (zw_u8*)block + zw__arena_header_bytes + block->used;
+	block->used += size;
+	arena->last = ptr;
+	arena->last_size = size;
+
+	return ptr;
+}
+
+static void* zw__arena_reallocate(void* user_data, void* ptr, size_t old_size, size_t new_size) {
+	zw__arena* arena = (zw__arena*)user_data;
+	zw__arena_block* block = arena->blocks;
+	void* moved;
+
+	if (ptr && ptr == arena->last) {
+		size_t size = ZW_ROUND_UP(new_size, 16);
+		if (size <= arena->last_size || block->size - block->used >= size - arena->last_size) {
+			block->used = block->used - arena->last_size + size;
+			arena->last_size = size;
+			return ptr;
+		}
+	}
+
+	moved = zw__arena_allocate(user_data, new_size);
+	if (moved && ptr)
+		ZW_MEMMOVE(moved, ptr, old_size < new_size ? old_size : new_size);
+	return moved;
+}
+
+static void zw__arena_deallocate(void* user_data, void* ptr, size_t size) {
+	zw__arena* arena = (zw__arena*)user_data;
+	(void)size;
+
+	if (ptr && ptr == arena->last) {
+		arena->blocks->used -= arena->last_size;
+		arena->last = NULL;
+	}
+}
+
+static zw_allocator zw__arena_allocator(zw__arena* arena) {
+	zw_allocator allocator;
+	allocator.user_data     = arena;
+	allocator.allocate      = &zw__arena_allocate;
+	allocator.reallocate    = &zw__arena_reallocate;
+	allocator.deallocate    = &zw__arena_deallocate;
+	return allocator;
+}
+
+static void zw__arena_release(zw__arena* arena) {
+	while (arena->blocks) {
+		zw__arena_block* block = arena->blocks;
+		arena->blocks = block->next;
+		zw__free(&arena->base, block, zw__arena_header_bytes + block->size);
+	}
+	arena->last = NULL;
+}
+
 ////////////////////////////////////////////////////////////////
 // Stretchy buffer
 // zw__sbpush() == vector<>::push_back()
@@ -258,23 +776,23 @@ static zw_u32 zw__crc32(const zw_u8* buffer, size_t len, zw_u32 initial) {
 #define zw__sbn(a)              zw__sbraw(a)[1]
 
 #define zw__sbneedgrow(a,n)     ((a)==0 || zw__sbn(a)+n >= zw__sbm(a))
-#define zw__sbmaybegrow(a,n)    (zw__sbneedgrow(a,(n)) ? zw__sbgrow(a,n) : 0)
-#define zw__sbgrow(a,n)         zw__sbgrowf((void **) &(a), (n), sizeof(*(a)))
+#define zw__sbmaybegrow(al,a,n) (zw__sbneedgrow(a,(n)) ? zw__sbgrow(al,a,n) : 0)
+#define zw__sbgrow(al,a,n)      zw__sbgrowf((al), (void **) &(a), (n), sizeof(*(a)))
 
-#define zw__sbpush(a, v)        (zw__sbmaybegrow(a,1), (a)[zw__sbn(a)++] = (v))
+#define zw__sbpush(al,a,v)      (zw__sbmaybegrow(al,a,1), (a)[zw__sbn(a)++] = (v))
 #define zw__sbcount(a)          ((a) ? zw__sbn(a) : 0)
-#define zw__sbfree(a)           zw__sbfreef((void**) &(a))
+#define zw__sbfree(al,a)        zw__sbfreef((al), (void**) &(a), sizeof(*(a)))
 
-static void zw__sbfreef(void** arr) {
+static void zw__sbfreef(const zw_allocator* allocator, void** arr, size_t itemsize) {
 	if (*arr) {
-		ZW_FREE(zw__sbraw(*arr));
+		allocator->deallocate(allocator->user_data, zw__sbraw(*arr), zw__sbm(*arr)*itemsize + sizeof(size_t)*2);
 		*arr = NULL;
 	}
 }
 
-static void *zw__sbgrowf(void **arr, size_t increment, size_t itemsize) {
+static void *zw__sbgrowf(const zw_allocator* allocator, void **arr, size_t increment, size_t itemsize) {
 	size_t m = *arr ? 2*zw__sbm(*arr)+increment : increment+1;
-	void *p = ZW_REALLOC_SIZED(*arr ? zw__sbraw(*arr) : 0, *arr ? (zw__sbm(*arr)*itemsize + sizeof(size_t)*2) : 0, itemsize * m + sizeof(size_t)*2);
+	void *p = allocator->reallocate(allocator->user_data, *arr ? zw__sbraw(*arr) : 0, *arr ? (zw__sbm(*arr)*itemsize + sizeof(size_t)*2) : 0, itemsize * m + sizeof(size_t)*2);
 	ZW_ASSERT(p);
 	if (p) {
 		if (!*arr) ((size_t *) p)[1] = 0;
@@ -286,31 +804,78 @@ static void *zw__sbgrowf(void **arr, size_t increment, size_t itemsize) {
 
 ////////////////////////////////////////////////////////////////
 
-typedef struct zw__zip_details {
-	zw_u32              magic;
+enum {
+	zw__check_crc32     = 1,
+	zw__check_adler32   = 2,
+};
 
+// Compressor state, shared by ZIP entries and standalone deflate streams
+typedef struct zw__deflate_state {
+	// hot: used for every input byte and output symbol, these fill the first cache line (on 64-bit)
+	zw_u8*              out;            // output buffer, the owner may put its own headers in it too
+	size_t              out_cursor;
+	size_t              out_total;
 	unsigned            bitbuf;
 	unsigned            bitcount;
-	zw_u8               quality;
-
-	zw_u8*              out;
-	zw_u16              out_cursor;
-	zw_u16              out_total;
-	
 	zw_u8*              window;
 	zw_u16              in_cursor;
 	zw_u16              in_total;
+	zw_u32              hash_mask;
+	zw_u16**            hash_table;     // chains in stretchy buffers, NULL for the low memory profile
+	zw_u16*             chains;         // low memory profile: chains in one fixed table instead,
+
+	zw_u8*              chain_counts;   // 2*quality slots per hash
+	zw_u16*             touched;        // the non-empty chains, so small streams don't have to visit all of them
+	zw_u16              touched_count;  // zw__max_touched + 1 once there are too many to list
+	zw_u8               quality;
+	zw_bool             block_open;     // a block header went out, its end of block code not yet
+	zw_bool             block_final;
+	const zw_allocator* allocator;      // for the hash chains
+	void                (*out_full)(void* owner);
+	void*               owner;
+
+	zw_u8               check;          // zw__check_* flags, checksums kept over the input
+	zw_u32              crc;
+	zw_u32              adler;
+	zw_u64              total_in;
+} zw__deflate_state;
+
+typedef struct zw__zip_details {
+	zw__deflate_state   deflate;        // first, so its hot fields share the block's first cache line
+
+	zw_u32              magic;
 
-	zw_u16**            hash_table;
+	zw_allocator        allocator;      // everything allocated per archive, an arena over base in arena mode
+	zw_allocator        base;
+	void*               block;          // the archive's own block, from base (or mapped, for huge pages)
+	size_t              block_bytes;
+	zw_bool             huge_pages;       // the block really is mapped in huge pages
+	zw_bool             want_huge_pages;  // huge pages were asked for; pooled contexts are matched on this
+	zw__arena           arena;
 
 	zw_output_stream    stream;
-	zw_u64              offset;
+	zw_u64              offset;         // bytes passed to the stream (see zw__tell)
+	zw_bool             non_blocking;
+	zw_u8*              pending;        // stretchy buffer, bytes a non-blocking stream didn't take yet (counted in offset)
+	size_t              pending_cursor;
+	zw_bool             finishing;
+	zw_bool             reusable;
+	zw_bool             low_memory;
+	size_t              tiny_entry_size;
+	zw_u8*              own_out;        // the output buffer in the archive's block, deflate.out may be one a stream handed back
+	size_t              out_capacity;
+	struct zw__zip_details* pool_next;
+	size_t              pool_bytes;     // memory held while in the pool
 
 	struct {
 	    zw_u64          start_offset;
+	    zw_u64          data_offset;
 	    zw_u64          compressed_size;
 	    zw_u64          uncompressed_size;
 	    zw_u32          crc;
+	    zw_u16          method;
+	    zw_u16          flags;
+	    zw_bool         raw;            // data is written verbatim, sizes and crc declared up front
 	    zw_u16          name_length;
 	    char            name_buf[64];
 	    char*           name;
@@ -319,12 +884,26 @@ typedef struct zw__zip_details {
 	zw_u16              time;
 	zw_u16              date;
 
-	zw_u8*              central_dir;
+	zw_u8*              central_dir;    // stretchy buffer, the records not spilled yet
 	zw_u64              num_files;
-} zw__zip_details;
 
-#define ZW_FOURCC(a, b, c, d)       (((a)) | ((b)<<8) | ((c)<<16) | ((d)<<24))
-#define ZW_ROUND_UP(x, pow2)        (((x)+((pow2)-1)) & ~((pow2)-1))
+	struct {
+	    size_t          limit;          // 0 if everything stays in memory
+	    FILE*           file;
+	    zw_u64          size;           // bytes written to file
+	}                   spill;
+
+	struct {
+	    char*           dir;            // stretchy buffer, empty if caching is disabled
+	    FILE*           file;           // records the entry being compressed on a cache miss
+	    char*           temp_path;
+	    zw_bool         teeing;         // compressed bytes from out + mark onward go to the cache file
+	    size_t          mark;
+	    zw_u32          crc;
+	    zw_u64          size;
+	    zw_u64          hash;
+	}                   cache;
+} zw__zip_details;
 
 enum {
 	// only used for easier identification in memory dumps
@@ -333,16 +912,54 @@ enum {
 
 ////////////////////////////////////////////////////////////////
 
+// Non-blocking streams may take less than they are given, the rest waits in pending
+static zw_bool zw__keep_pending(zw_zip archive, const void* data, size_t size) {
+	zw__sbmaybegrow(&archive->allocator, archive->pending, size);
+	ZW_MEMMOVE(archive->pending + zw__sbn(archive->pending), data, size);
+	zw__sbn(archive->pending) += size;
+	archive->offset += size;
+	return zw_true;
+}
+
+// Tries to get the pending bytes out, true once there are none left
+static zw_bool zw__drain_pending(zw_zip archive) {
+	size_t count = zw__sbcount(archive->pending);
+
+	if (archive->pending_cursor < count) {
+		if (archive->stream.error)
+			return zw_false;
+		archive->pending_cursor += archive->stream.write(&archive->stream, archive->pending + archive->pending_cursor, count - archive->pending_cursor);
+		if (archive->pending_cursor < count)
+			return zw_false;
+	}
+	if (archive->pending)
+		zw__sbn(archive->pending) = 0;
+	archive->pending_cursor = 0;
+
+	return zw_true;
+}
+
+// Public calls take no new work once the stream failed, or while a non-blocking stream still has output waiting
+static zw_bool zw__ready(zw_zip archive) {
+	if (archive->stream.error)
+		return zw_false;
+	return !archive->non_blocking || zw__drain_pending(archive) ? zw_true : zw_false;
+}
+
 static zw_bool zw__write_to_stream(zw_zip archive, const void* data, size_t size) {
 	if (!size)
 		return zw_true;
 	if (archive->stream.error)
 		return zw_false;
+	if (archive->non_blocking && !zw__drain_pending(archive))
+		return archive->stream.error ? zw_false : zw__keep_pending(archive, data, size);
 
 	size_t written = archive->stream.write(&archive->stream, data, size);
 	archive->offset += written;
 	if (written == size)
 		return zw_true;
+	if (archive->non_blocking && !archive->stream.error)
+		return zw__keep_pending(archive, (const zw_u8*)data + written, size - written);
 
 	// if write failed and no explicit error code was set, use a default one
 	if (!archive->stream.error)
@@ -350,22 +967,156 @@ static zw_bool zw__write_to_stream(zw_zip archive, const void* data, size_t size
 	return zw_false;
 }
 
-static void zw__flush_compressed_bytes(zw_zip archive) {
-	if (archive->out_cursor > 0) {
-		archive->current_file.compressed_size += archive->out_cursor;
-		zw__write_to_stream(archive, archive->out, archive->out_cursor);
-		archive->out_cursor = 0;
+static zw_bool zw__write_to_stream_v(zw_zip archive, const zw_iovec* iov, int count) {
+	size_t size = 0, written = 0;
+	int i;
+
+	if (archive->stream.error)
+		return zw_false;
+
+	for (i = 0; i < count; ++i)
+		size += iov[i].size;
+
+	if (archive->non_blocking && !zw__drain_pending(archive)) {
+		if (archive->stream.error)
+			return zw_false;
+		for (i = 0; i < count; ++i)
+			zw__keep_pending(archive, iov[i].data, iov[i].size);
+		return zw_true;
+	}
+
+	if (archive->stream.writev) {
+		written = archive->stream.writev(&archive->stream, iov, count);
+	} else {
+		for (i = 0; i < count; ++i) {
+			size_t part = iov[i].size ? archive->stream.write(&archive->stream, iov[i].data, iov[i].size) : 0;
+			written += part;
+			if (part != iov[i].size)
+				break;
+		}
+	}
+	archive->offset += written;
+	if (written == size)
+		return zw_true;
+
+	if (archive->non_blocking && !archive->stream.error) {
+		for (i = 0; i < count; ++i) {
+			size_t skip = written < iov[i].size ? written : iov[i].size;
+			written -= skip;
+			zw__keep_pending(archive, (const zw_u8*)iov[i].data + skip, iov[i].size - skip);
+		}
+		return zw_true;
+	}
+
+	if (!archive->stream.error)
+		archive->stream.error = 1;
+	return zw_false;
+}
+
+// Position in the archive, including buffered bytes
+static ZW_INLINE zw_u64 zw__tell(zw_zip archive) {
+	return archive->offset + archive->deflate.out_cursor;
+}
+
+static void zw__cache_tee(zw_zip archive) {
+	if (archive->deflate.out_cursor > archive->cache.mark)
+		fwrite(archive->deflate.out + archive->cache.mark, 1, archive->deflate.out_cursor - archive->cache.mark, archive->cache.file);
+	archive->cache.mark = archive->deflate.out_cursor;
+}
+
+static zw_bool zw__flush_output(zw_zip archive) {
+	zw_bool result;
+
+	if (archive->cache.teeing) {
+		zw__cache_tee(archive);
+		archive->cache.mark = 0;
+	}
+
+	// hand the buffer off and keep going with a fresh one
+	if (archive->stream.submit && archive->deflate.out_cursor > 0) {
+		void* next;
+		if (archive->stream.error) {
+			// dropped, as on the synchronous path, so the compressor keeps writing inside the buffer
+			archive->deflate.out_cursor = 0;
+			return zw_false;
+		}
+		next = archive->stream.submit(&archive->stream, archive->deflate.out, archive->deflate.out_cursor, archive->deflate.out_total);
+		if (next) {
+			archive->offset += archive->deflate.out_cursor;
+			archive->deflate.out = (zw_u8*)next;
+			archive->deflate.out_cursor = 0;
+			return archive->stream.error ? zw_false : zw_true;
+		}
+	}
+
+	result = zw__write_to_stream(archive, archive->deflate.out, archive->deflate.out_cursor);
+	archive->deflate.out_cursor = 0;
+
+	return result;
+}
+
+static void zw__zip_out_full(void* owner) {
+	zw__flush_output((zw_zip)owner);
+}
+
+// Buffered write, the stream only gets called for full buffers (or data larger than a buffer)
+static zw_bool zw__write_output(zw_zip archive, const void* data, size_t size) {
+	size_t avail = archive->deflate.out_total - archive->deflate.out_cursor;
+
+	if (!size)
+		return zw_true;
+	if (archive->stream.error)
+		return zw_false;
+
+	if (size < avail) {
+		ZW_MEMMOVE(archive->deflate.out + archive->deflate.out_cursor, data, size);
+		archive->deflate.out_cursor += size;
+		return zw_true;
+	}
+
+	// send large blocks together with whatever is buffered, without copying them
+	if (archive->stream.writev && size >= archive->deflate.out_total) {
+		zw_iovec iov[2];
+		zw_bool result;
+
+		if (archive->cache.teeing) {
+			zw__cache_tee(archive);
+			archive->cache.mark = 0;
+		}
+		iov[0].data = archive->deflate.out;
+		iov[0].size = archive->deflate.out_cursor;
+		iov[1].data = data;
+		iov[1].size = size;
+		result = zw__write_to_stream_v(archive, iov, 2);
+		archive->deflate.out_cursor = 0;
+
+		return result;
 	}
+
+	ZW_MEMMOVE(archive->deflate.out + archive->deflate.out_cursor, data, avail);
+	archive->deflate.out_cursor += avail;
+	data = (const zw_u8*)data + avail;
+	size -= avail;
+	if (!zw__flush_output(archive))
+		return zw_false;
+
+	if (size >= archive->deflate.out_total)
+		return zw__write_to_stream(archive, data, size);
+
+	ZW_MEMMOVE(archive->deflate.out, data, size);
+	archive->deflate.out_cursor = size;
+
+	return zw_true;
 }
 
-static ZW_INLINE void zw__flush_bits(zw_zip archive) {
-   while (archive->bitcount >= 8) {
-		archive->out[archive->out_cursor++] = archive->bitbuf & 0xff;
-		if (archive->out_cursor == archive->out_total) {
-			zw__flush_compressed_bytes(archive);
+static ZW_INLINE void zw__flush_bits(zw__deflate_state* state) {
+   while (state->bitcount >= 8) {
+		state->out[state->out_cursor++] = state->bitbuf & 0xff;
+		if (state->out_cursor == state->out_total) {
+			state->out_full(state->owner);
 		}
-		archive->bitbuf >>= 8;
-		archive->bitcount -= 8;
+		state->bitbuf >>= 8;
+		state->bitcount -= 8;
    }
 }
 
@@ -424,9 +1175,9 @@ static ZW_INLINE zw_u32 zw__zhash(const zw_u8 *data) {
 	return hash;
 }
 
-#define zw__zlib_flush() zw__flush_bits(archive)
+#define zw__zlib_flush() zw__flush_bits(state)
 #define zw__zlib_add(code,codebits) \
-	(archive->bitbuf |= (code) << archive->bitcount, archive->bitcount += (codebits), zw__zlib_flush())
+	(state->bitbuf |= (code) << state->bitcount, state->bitcount += (codebits), zw__zlib_flush())
 #define zw__zlib_huffa(b,c)  zw__zlib_add(zw__zlib_bitrev(b,c),c)
 // default huffman tables
 #define zw__zlib_huff1(n)  zw__zlib_huffa(0x30 + (n), 8)
@@ -438,54 +1189,201 @@ static ZW_INLINE zw_u32 zw__zhash(const zw_u8 *data) {
 
 enum {
 	zw__hash_size = 16384,
-};
+	zw__output_bytes = 256 * 1024,  // headers and data of many small entries go out in one stream write
 
-static void zw__flush_input(zw_zip archive) {
-	static const zw_u16 lengthc[]     = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
-	static const zw_u8  lengtheb[]    = { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
-	static const zw_u16 distc[]       = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
-	static const zw_u8  disteb[]      = { 0,0,0,0,1,1,2, 2, 3, 3, 4, 4, 5, 5,  6,  6,  7,  7,  8,  8,   9,   9,  10,  10,  11,  11,  12,   12,   13,   13 };
+	// low memory profile
+	zw__low_memory_hash_size    = 4096,
+	zw__low_memory_quality      = 4,
+	zw__low_memory_input        = 8192,
+	zw__low_memory_output       = 4096,
 
-	const zw_u8* data = archive->window + 32768;
-	zw_u16 i,j, data_len = archive->in_cursor;
+	zw__max_touched             = 1024,
 
-	if (data_len == 0)
+	// tiny entries
+	zw__max_tiny_entry          = 16384,    // compressed into the window's history half, which has room for 32 KB
+	zw__tiny_hash_size          = 1024,
+};
+
+// Blocks are only started once there is something to put in them, so a stream that ends before
+// its first flush gets a single final block. Otherwise an empty final block closes the stream.
+static void zw__open_block(zw__deflate_state* state, zw_bool final) {
+	if (state->block_open)
 		return;
-	ZW_ASSERT(data_len <= 32768);
+	zw__zlib_add(final ? 1 : 0, 1);  // BFINAL
+	zw__zlib_add(1,2);  // BTYPE  = 01 (fixed Huffman)
+	state->block_open = zw_true;
+	state->block_final = final;
+}
 
-	i=0;
-	while (i < data_len-3) {
-		// hash next 3 bytes of data to be compressed
-		zw_u32 h = zw__zhash(data + i) & (zw__hash_size - 1);
-		zw_u16 best = 3;
-		unsigned char *bestloc = 0;
-		zw_u16 *hlist = archive->hash_table[h];
-		size_t n = zw__sbcount(hlist);
-		for (j = 0; j < n; ++j) {
-			if (hlist[j] > i) { // if entry lies within window
-				zw_u16 d = zw__zlib_countm(archive->window + hlist[j], data + i, data_len - i);
-				if (d >= best) {
-					best = d;
-					bestloc = hlist[j] + archive->window;
-				}
-			}
-		}
-		// when hash table entry is too long, delete half the entries
-		if (hlist && zw__sbn(hlist) == 2u * archive->quality) {
-			ZW_MEMMOVE(hlist, hlist + archive->quality, sizeof(hlist[0]) * archive->quality);
-			zw__sbn(hlist) = archive->quality;
-		}
-		zw__sbpush(archive->hash_table[h], (zw_u16)(i + 32768));
+static void zw__close_block(zw__deflate_state* state) {
+	if (!state->block_open)
+		return;
+	zw__zlib_huff(256); // end of block
+	state->block_open = zw_false;
+}
 
-		if (bestloc) {
-			// "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-			h = zw__zhash(data + i + 1) & (zw__hash_size - 1);
-			hlist = archive->hash_table[h];
-			n = zw__sbcount(hlist);
-			for (j = 0; j < n; ++j) {
-				if (hlist[j] > i + 1) {
-					zw_u16 e = zw__zlib_countm(archive->window + hlist[j], data + i + 1, data_len - i - 1);
-					if (e > best) { // if next match is better, bail on current match
+// Hash chains keep up to 2*quality positions each; the older half is dropped when one is full
+
+static zw_u16* zw__chain(zw__deflate_state* state, zw_u32 h, size_t* count) {
+	if (state->chains) {
+		*count = state->chain_counts[h];
+		return state->chains + h * 2u * state->quality;
+	}
+	*count = zw__sbcount(state->hash_table[h]);
+	return state->hash_table[h];
+}
+
+static void zw__chain_resize(zw__deflate_state* state, zw_u32 h, size_t count) {
+	if (state->chains)
+		state->chain_counts[h] = (zw_u8)count;
+	else if (state->hash_table[h])
+		zw__sbn(state->hash_table[h]) = count;
+}
+
+static void zw__touch_chain(zw__deflate_state* state, zw_u32 h) {
+	if (state->touched_count < zw__max_touched)
+		state->touched[state->touched_count++] = (zw_u16)h;
+	else
+		state->touched_count = zw__max_touched + 1;  // from now on, sliding and resets go through all chains
+}
+
+static void zw__chain_push(zw__deflate_state* state, zw_u32 h, zw_u16 pos) {
+	size_t count;
+	zw_u16* hlist = zw__chain(state, h, &count);
+
+	if (!count)
+		zw__touch_chain(state, h);
+	if (count == 2u * state->quality) {
+		ZW_MEMMOVE(hlist, hlist + state->quality, sizeof(hlist[0]) * state->quality);
+		count = state->quality;
+	}
+	if (state->chains) {
+		hlist[count] = pos;
+		state->chain_counts[h] = (zw_u8)(count + 1);
+		return;
+	}
+	if (!hlist)
+		zw__sbgrow(state->allocator, state->hash_table[h], 2u * state->quality); // full size, so it never has to grow again
+	else
+		zw__sbn(hlist) = count;
+	zw__sbpush(state->allocator, state->hash_table[h], pos);
+}
+
+// Moves a chain's positions shift bytes back, dropping those that leave the window
+static size_t zw__slide_chain(zw__deflate_state* state, zw_u32 h, zw_u16 shift) {
+	size_t valid = 0, total, k;
+	zw_u16* hlist = zw__chain(state, h, &total);
+
+	for (k = 0; k < total; ++k) {
+		zw_u16 ofs = hlist[k];
+		if (ofs >= shift)
+			hlist[valid++] = ofs - shift;
+	}
+	zw__chain_resize(state, h, valid);
+
+	return valid;
+}
+
+static void zw__slide_chains(zw__deflate_state* state, zw_u16 shift) {
+	zw_u32 h, k, kept = 0;
+
+	if (state->touched_count <= zw__max_touched) {
+		for (k = 0; k < state->touched_count; ++k) {
+			h = state->touched[k];
+			if (zw__slide_chain(state, h, shift))
+				state->touched[kept++] = (zw_u16)h;
+		}
+		state->touched_count = (zw_u16)kept;
+		return;
+	}
+
+	// too many to have listed them, but the ones left afterwards may fit in the list again
+	state->touched_count = 0;
+	for (h = 0; h <= state->hash_mask; ++h)
+		if (zw__slide_chain(state, h, shift))
+			zw__touch_chain(state, h);
+}
+
+static void zw__reset_hash(zw__deflate_state* state) {
+	zw_u32 i;
+
+	// reset lengths of hash table chains
+	if (state->touched_count <= zw__max_touched) {
+		for (i = 0; i < state->touched_count; ++i)
+			zw__chain_resize(state, state->touched[i], 0);
+	} else if (state->chains) {
+		memset(state->chain_counts, 0, state->hash_mask + 1);
+	} else {
+		for (i = 0; i <= state->hash_mask; ++i) {
+			zw_u16 *hlist = state->hash_table[i];
+			if (hlist)
+				zw__sbn(hlist) = 0;
+		}
+	}
+	state->touched_count = 0;
+}
+
+static void zw__free_chains(zw__deflate_state* state) {
+	zw_u32 i;
+
+	if (state->hash_table)
+		for (i = 0; i <= state->hash_mask; ++i)
+			zw__sbfree(state->allocator, state->hash_table[i]);
+}
+
+static ZW_INLINE void zw__zlib_match(zw__deflate_state* state, zw_u16 length, zw_u16 distance) {
+	static const zw_u16 lengthc[]     = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+	static const zw_u8  lengtheb[]    = { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+	static const zw_u16 distc[]       = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+	static const zw_u8  disteb[]      = { 0,0,0,0,1,1,2, 2, 3, 3, 4, 4, 5, 5,  6,  6,  7,  7,  8,  8,   9,   9,  10,  10,  11,  11,  12,   12,   13,   13 };
+	zw_u16 j;
+
+	ZW_ASSERT(distance <= 32767 && length <= 258);
+	for (j=0; length>lengthc[j+1]-1; ++j);
+	zw__zlib_huff(j + 257);
+	if (lengtheb[j]) zw__zlib_add(length - lengthc[j], lengtheb[j]);
+	for (j=0; distance>distc[j+1]-1; ++j);
+	zw__zlib_add(zw__zlib_bitrev(j, 5), 5);
+	if (disteb[j]) zw__zlib_add(distance - distc[j], disteb[j]);
+}
+
+static void zw__flush_input(zw__deflate_state* state, zw_bool final) {
+	const zw_u8* data = state->window + 32768;
+	zw_u16 i,j, data_len = state->in_cursor;
+	zw_u32 h;
+
+	if (data_len == 0)
+		return;
+	ZW_ASSERT(data_len <= 32768);
+	zw__open_block(state, final);
+
+	i=0;
+	while (i < data_len-3) {
+		// hash next 3 bytes of data to be compressed
+		h = zw__zhash(data + i) & state->hash_mask;
+		zw_u16 best = 3;
+		unsigned char *bestloc = 0;
+		size_t n;
+		zw_u16 *hlist = zw__chain(state, h, &n);
+		for (j = 0; j < n; ++j) {
+			if (hlist[j] > i) { // if entry lies within window
+				zw_u16 d = zw__zlib_countm(state->window + hlist[j], data + i, data_len - i);
+				if (d >= best) {
+					best = d;
+					bestloc = hlist[j] + state->window;
+				}
+			}
+		}
+		zw__chain_push(state, h, (zw_u16)(i + 32768));
+
+		if (bestloc) {
+			// "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
+			h = zw__zhash(data + i + 1) & state->hash_mask;
+			hlist = zw__chain(state, h, &n);
+			for (j = 0; j < n; ++j) {
+				if (hlist[j] > i + 1) {
+					zw_u16 e = zw__zlib_countm(state->window + hlist[j], data + i + 1, data_len - i - 1);
+					if (e > best) { // if next match is better, bail on current match
 						bestloc = NULL;
 						break;
 					}
@@ -494,14 +1392,7 @@ static void zw__flush_input(zw_zip archive) {
 		}
 
 		if (bestloc) {
-			zw_u16 d = (zw_u16)(data + i - bestloc); // distance back
-			ZW_ASSERT(d <= 32767 && best <= 258);
-			for (j=0; best>lengthc[j+1]-1; ++j);
-			zw__zlib_huff(j + 257);
-			if (lengtheb[j]) zw__zlib_add(best - lengthc[j], lengtheb[j]);
-			for (j=0; d>distc[j+1]-1; ++j);
-			zw__zlib_add(zw__zlib_bitrev(j, 5), 5);
-			if (disteb[j]) zw__zlib_add(d - distc[j], disteb[j]);
+			zw__zlib_match(state, best, (zw_u16)(data + i - bestloc)); // distance back
 			i += best;
 		} else {
 			zw__zlib_huffb(data[i]);
@@ -514,29 +1405,145 @@ static void zw__flush_input(zw_zip archive) {
 		zw__zlib_huffb(data[i]);
 
 	// slide window and remove hash table entries that point too far back
-	for (i = 0; i < zw__hash_size; ++i) {
-		zw_u16 *hlist = archive->hash_table[i];
-		size_t valid, total;
-		if (!hlist)
-			continue;
+	zw__slide_chains(state, state->in_cursor);
+	ZW_MEMMOVE(state->window, state->window + state->in_cursor, 32768);
+
+	state->total_in += data_len;
+	if (state->check & zw__check_crc32)
+		state->crc = zw__crc32(data, data_len, state->crc);
+	if (state->check & zw__check_adler32)
+		state->adler = zw__adler32(data, data_len, state->adler);
+
+	state->in_cursor = 0;
+}
+
+// Starts a new stream; the hash chains are kept, callers reset them when the previous input must not be matched
+static void zw__deflate_begin(zw__deflate_state* state) {
+	state->block_open = zw_false;
+	state->in_cursor = 0;
+	state->crc = 0;
+	state->adler = 1;
+	state->total_in = 0;
+}
+
+static void zw__deflate_write(zw__deflate_state* state, const void* data, size_t data_len) {
+	while (data_len > 0) {
+		zw_u16 avail = state->in_total - state->in_cursor;
+		zw_u16 batch = data_len < avail ? (zw_u16)data_len : avail;
+		ZW_MEMMOVE(state->window + 32768 + state->in_cursor, data, batch);
+		state->in_cursor += batch;
+		if (state->in_cursor == state->in_total)
+			zw__flush_input(state, zw_false);
+		data_len -= batch;
+		data = (const zw_u8*)data + batch;
+	}
+}
+
+// Ends the current block with an empty stored one, which brings the output to a byte boundary.
+// zw_flush_full also forgets the history, so decoding can restart from this point.
+static void zw__deflate_sync(zw__deflate_state* state, zw_flush_mode mode) {
+	zw__flush_input(state, zw_false);
+	zw__close_block(state);
 
-		valid = 0;
-		total = zw__sbn(hlist);
-		for (j = 0; j < total; ++j) {
-			zw_u16 ofs = hlist[j];
-			if (ofs >= archive->in_cursor) {
-				hlist[valid++] = ofs - archive->in_cursor;
+	zw__zlib_add(0,1);  // BFINAL = 0
+	zw__zlib_add(0,2);  // BTYPE  = 00 (stored)
+	while (state->bitcount)
+		zw__zlib_add(0,1);
+	zw__zlib_add(0x0000,16);  // LEN
+	zw__zlib_add(0xffff,16);  // NLEN
+
+	if (mode == zw_flush_full)
+		zw__reset_hash(state);
+}
+
+static void zw__deflate_end(zw__deflate_state* state) {
+	zw__flush_input(state, zw_true);
+	if (!state->block_final)
+		zw__close_block(state);
+	zw__open_block(state, zw_true);
+	zw__close_block(state);
+
+	// pad with 0 bits to byte boundary
+	while (state->bitcount)
+		zw__zlib_add(0,1);
+}
+
+// One final block for a whole small input, with a greedy single-probe matcher over a hash table on the stack.
+// Nothing of the compressor state is used, so the chains need no upkeep; out must have room for 9/8 of data_len + 3.
+static size_t zw__deflate_tiny(zw_u8* out, const zw_u8* data, zw_u16 data_len) {
+	zw__deflate_state tiny;
+	zw__deflate_state* state = &tiny;
+	zw_u16 head[zw__tiny_hash_size];    // position + 1 of the last time each hash was seen
+	zw_u16 i = 0;
+
+	memset(&tiny, 0, sizeof(tiny));
+	memset(head, 0, sizeof(head));
+	tiny.out = out;
+	tiny.out_total = (size_t)-1;
+
+	zw__open_block(state, zw_true);
+	while (i + 3 < data_len) {
+		zw_u32 h = zw__zhash(data + i) & (zw__tiny_hash_size - 1);
+		zw_u16 candidate = head[h];
+		head[h] = (zw_u16)(i + 1);
+		if (candidate) {
+			zw_u16 length = zw__zlib_countm(data + candidate - 1, data + i, data_len - i);
+			if (length >= 3) {
+				zw__zlib_match(state, length, (zw_u16)(i + 1 - candidate));
+				i += length;
+				continue;
 			}
 		}
+		zw__zlib_huffb(data[i]);
+		++i;
+	}
+	for (; i < data_len; ++i)
+		zw__zlib_huffb(data[i]);
+	zw__close_block(state);
+
+	while (state->bitcount)
+		zw__zlib_add(0,1);
+
+	return tiny.out_cursor;
+}
+
+// Bytes the window and hash table take in the memory block
+static size_t zw__deflate_bytes(zw_bool low_memory) {
+	const size_t touched_bytes = zw__max_touched * sizeof(zw_u16);
 
-		zw__sbn(hlist) = valid;
+	if (low_memory)
+		return ZW_ROUND_UP(32768 + zw__low_memory_input + zw__low_memory_hash_size * (2 * zw__low_memory_quality * sizeof(zw_u16) + 1) + touched_bytes, 64);
+	return 65536 + zw__hash_size * sizeof(zw_u16**) + touched_bytes;
+}
+
+// Window, hash table and output buffer, carved out of memory laid out by the caller
+static zw_u8* zw__deflate_init(zw__deflate_state* state, zw_u8* mem_block, size_t output_bytes, zw_bool low_memory) {
+	state->allocator = &zw__default_allocator;
+	state->window = mem_block;
+	if (low_memory) {
+		state->quality = zw__low_memory_quality;
+		state->in_total = zw__low_memory_input;
+		state->hash_mask = zw__low_memory_hash_size - 1;
+		state->chains = (zw_u16*)(mem_block + 32768 + zw__low_memory_input);
+		state->chain_counts = (zw_u8*)(state->chains + zw__low_memory_hash_size * 2 * zw__low_memory_quality);
+		memset(state->chain_counts, 0, zw__low_memory_hash_size);
+		state->touched = (zw_u16*)(state->chain_counts + zw__low_memory_hash_size);
+	} else {
+		state->quality = 8;
+		state->in_total = 32768;
+		state->hash_mask = zw__hash_size - 1;
+		state->hash_table = (zw_u16**)(mem_block + 65536);
+		memset(state->hash_table, 0, zw__hash_size * sizeof(zw_u16**));
+		state->touched = (zw_u16*)(state->hash_table + zw__hash_size);
 	}
-	ZW_MEMMOVE(archive->window, archive->window + archive->in_cursor, 32768);
+	state->touched_count = 0;
+	mem_block += zw__deflate_bytes(low_memory);
 
-	archive->current_file.uncompressed_size += data_len;
-	archive->current_file.crc = zw__crc32(data, data_len, archive->current_file.crc);
+	state->out = mem_block;
+	state->out_total = output_bytes;
+	mem_block += output_bytes;
 
-	archive->in_cursor = 0;
+	return mem_block;
 }
 
 ////////////////////////////////////////////////////////////////
@@ -551,11 +1558,13 @@ enum {
 	zw__zip_sig_eocdloc64               = 0x07064b50,
 
 	zw__zip_info64_id                   = 0x0001,
+	zw__zip_unicode_path_id             = 0x7075,   // holds a crc of the header's name
 	zw__zip_file_system_fat             = 0,
 
 	zw__zip_compression_method_store    = 0,
 	zw__zip_compression_method_deflate  = 8,
 
+	zw__zip_flag_encrypted              = 1 << 0,
 	zw__zip_flag_has_data_desc          = 1 << 3,
 };
 
@@ -620,6 +1629,13 @@ typedef struct {
 } zw__zip_info64;
 ZW_STATIC_ASSERT(sizeof(zw__zip_info64) == 28);
 
+typedef struct {
+	zw__zip_extra_header    header;
+	zw_u64                  uncompressed_size;
+	zw_u64                  compressed_size;
+} zw__zip_local_info64;
+ZW_STATIC_ASSERT(sizeof(zw__zip_local_info64) == 20);
+
 typedef struct {
 	zw_u32              signature;
 	zw_u64              end_of_central_dir_64_size;
@@ -681,7 +1697,16 @@ static zw_u16 zw__zip_encode_date(unsigned year, unsigned month, unsigned day) {
 
 // STDIO stream ////////////////////////////////////////////////
 
-#include <stdio.h>
+#if defined(_MSC_VER)
+	#include <io.h>     // _chsize_s
+	#define ZW__TRUNCATE
+	#define zw__fseek64(file, ofs)  _fseeki64(file, (__int64)(ofs), SEEK_SET)
+#elif defined(ZW__POSIX)
+	#define ZW__TRUNCATE
+	#define zw__fseek64(file, ofs)  fseeko(file, (off_t)(ofs), SEEK_SET)
+#else
+	#define zw__fseek64(file, ofs)  fseek(file, (long)(ofs), SEEK_SET)
+#endif
 
 static size_t zw__write_stdio(zw_output_stream* stream, const void* data, size_t size) {
 	FILE* file = (FILE*)stream->user_data;
@@ -691,250 +1716,2417 @@ static size_t zw__write_stdio(zw_output_stream* stream, const void* data, size_t
 	return written;
 }
 
+static void zw__flush_stdio(struct zw_output_stream* stream) {
+	if (fflush((FILE*)stream->user_data) != 0 && !stream->error)
+		stream->error = 1;
+}
+
 static void zw__close_stdio(struct zw_output_stream* stream) {
 	FILE* file = (FILE*)stream->user_data;
 	if (file)
 		fclose(file);
 }
 
-// Archive functionality ///////////////////////////////////////
+// Used for archives opened in append mode, which can end up shorter than the original file
+// (e.g. when the original had a comment)
+#ifdef ZW__TRUNCATE
+static void zw__close_stdio_truncate(struct zw_output_stream* stream) {
+	FILE* file = (FILE*)stream->user_data;
+	if (file && fflush(file) == 0) {
+#if defined(ZW__POSIX)
+		// the fd position also accounts for bytes written through copy_fd
+		off_t end = lseek(fileno(file), 0, SEEK_CUR);
+		if (end < 0 || ftruncate(fileno(file), end) != 0)
+			stream->error = 1;
+#else
+		__int64 end = _ftelli64(file);
+		if (end < 0 || _chsize_s(_fileno(file), end) != 0)
+			stream->error = 1;
+#endif
+	}
+	zw__close_stdio(stream);
+}
+#endif // def ZW__TRUNCATE
 
-static zw_bool zw__append_to_central_dir(zw_zip archive, const void* data, size_t size) {
-	if (!size)
-		return zw_true;
-	zw__sbmaybegrow(archive->central_dir, size);
-	ZW_MEMMOVE(archive->central_dir + zw__sbn(archive->central_dir), data, size);
-	zw__sbn(archive->central_dir) += size;
-	return zw_true;
+#ifdef ZW__POSIX
+
+static size_t zw__write_fd(int fd, const void* data, size_t size) {
+	size_t written = 0;
+	while (written < size) {
+		ssize_t result = write(fd, (const zw_u8*)data + written, size - written);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+		written += (size_t)result;
+	}
+	return written;
 }
 
-zw_zip zw_create(const char* file_path) {
-	zw_zip_options options;
-	FILE* file = fopen(file_path, "wb");
-	zw_zip archive;
+static size_t zw__writev_fd(int fd, const zw_iovec* iov, int count) {
+	struct iovec vec[16];
+	size_t total = 0, done, part;
+	ssize_t result;
+	int i, j, n;
 
-	if (!file)
-		return NULL;
+	for (i = 0; i < count; i += n) {
+		for (n = 0; n < 16 && i + n < count; ++n) {
+			vec[n].iov_base = (void*)iov[i + n].data;
+			vec[n].iov_len  = iov[i + n].size;
+		}
 
-	memset(&options, 0, sizeof(options));
-	options.stream.user_data    = file;
-	options.stream.write        = &zw__write_stdio;
-	options.stream.close        = &zw__close_stdio;
+		result = writev(fd, vec, n);
+		done = result > 0 ? (size_t)result : 0;
 
-	archive = zw_create_ex(&options);
-	if (!archive) {
-		fclose(file);
-		return NULL;
+		// complete short writes one piece at a time
+		for (j = 0; j < n; ++j) {
+			if (done >= vec[j].iov_len) {
+				done  -= vec[j].iov_len;
+				total += vec[j].iov_len;
+				continue;
+			}
+			part = zw__write_fd(fd, (const zw_u8*)vec[j].iov_base + done, vec[j].iov_len - done);
+			total += done + part;
+			if (part < vec[j].iov_len - done)
+				return total;
+			done = 0;
+		}
 	}
 
-	return archive;
+	return total;
 }
 
-zw_zip zw_create_ex(const zw_zip_options* options) {
-	const size_t archive_bytes  = ZW_ROUND_UP(sizeof(zw__zip_details), 16);
-	const size_t window_bytes   = 65536;
-	const size_t output_bytes   = 32768;
-	const size_t hash_bytes     = zw__hash_size * sizeof(zw_u16**);
+static size_t zw__writev_stdio(zw_output_stream* stream, const zw_iovec* iov, int count) {
+	FILE* file = (FILE*)stream->user_data;
+	size_t written, size = 0;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		size += iov[i].size;
+	if (fflush(file) != 0) {
+		stream->error = ferror(file);
+		return 0;
+	}
+	written = zw__writev_fd(fileno(file), iov, count);
+	if (written != size)
+		stream->error = errno ? errno : 1;
 
-	const size_t total_bytes    = archive_bytes + window_bytes + hash_bytes + output_bytes;
+	return written;
+}
 
-	zw_u8* mem_block;
-	zw_zip archive;
+#endif // def ZW__POSIX
 
-	time_t rawtime;
-	struct tm* local;
+#ifdef ZW__ZERO_COPY
 
-	if (!options || !options->stream.write) {
-		return NULL;
+static size_t zw__copy_fd_to_fd(int dst_fd, int src_fd, zw_u64 offset, size_t size) {
+	size_t copied = 0;
+
+	#ifdef SYS_copy_file_range
+	{
+		// stays in the kernel (or the file system, for reflink-capable ones)
+		long long src_offset = (long long)offset;
+		while (copied < size) {
+			long result = syscall(SYS_copy_file_range, src_fd, &src_offset, dst_fd, NULL, size - copied, 0u);
+			if (result <= 0)
+				break;
+			copied += (size_t)result;
+		}
+	}
+	#endif // def SYS_copy_file_range
+
+	// copy_file_range refuses some fd combinations (e.g. across file systems on older kernels)
+	if (copied < size) {
+		off_t src_offset = (off_t)(offset + copied);
+		while (copied < size) {
+			ssize_t result = sendfile(dst_fd, src_fd, &src_offset, size - copied);
+			if (result <= 0)
+				break;
+			copied += (size_t)result;
+		}
 	}
 
-	mem_block = (zw_u8*) ZW_MALLOC(total_bytes);
-	if (!mem_block)
-		return NULL;
-	memset(mem_block, 0, total_bytes);
+	return copied;
+}
 
-	archive = (zw_zip)mem_block;
-	archive->magic = zw__archive_magic;
-	archive->quality = 8;
-	mem_block += archive_bytes;
+static size_t zw__copy_fd_stdio(zw_output_stream* stream, int src_fd, unsigned long long offset, size_t size) {
+	FILE* file = (FILE*)stream->user_data;
+	if (fflush(file) != 0)
+		return 0;
+	return zw__copy_fd_to_fd(fileno(file), src_fd, offset, size);
+}
 
-	archive->window = mem_block;
-	archive->in_total = 32768;
-	mem_block += window_bytes;
+#endif // def ZW__ZERO_COPY
 
-	archive->hash_table = (zw_u16**)mem_block;
-	mem_block += hash_bytes;
+// File descriptor stream (POSIX) /////////////////////////////
 
-	archive->out = mem_block;
-	archive->out_total = 32768;
+#ifdef ZW__POSIX
 
-	archive->stream = options->stream;
-	archive->current_file.name = archive->current_file.name_buf;
+enum {
+	zw__fd_writeback_bytes  = 8 * 1024 * 1024,
+};
 
-	time(&rawtime);
-	local = localtime(&rawtime);
-	archive->date = zw__zip_encode_date(local->tm_year + 1900, local->tm_mon + 1, local->tm_mday);
-	archive->time = zw__zip_encode_time(local->tm_hour, local->tm_min, local->tm_sec);
+typedef struct zw__uring zw__uring;
 
-	return archive;
+typedef struct {
+	int                 fd;
+	zw_bool             sync_writeback;
+	zw_u64              position;
+	zw_u64              preallocated;
+	zw_u64              synced;         // writeback was started up to here
+	zw_u64              settled;        // ...and has completed up to here
+	zw__uring*          uring;          // asynchronous writes, if enabled
+	zw_allocator        allocator;
+} zw__fd_stream;
+
+#ifdef ZW__SYNC_WRITEBACK
+// SYNC_FILE_RANGE_* values, part of the kernel ABI
+enum {
+	zw__sync_wait_before    = 1,
+	zw__sync_write          = 2,
+	zw__sync_wait_after     = 4,
+};
+
+static void zw__sync_file_range(int fd, zw_u64 offset, zw_u64 size, unsigned flags) {
+#ifdef SYS_sync_file_range2
+	syscall(SYS_sync_file_range2, fd, flags, (off_t)offset, (off_t)size);
+#else
+	syscall(SYS_sync_file_range, fd, (off_t)offset, (off_t)size, flags);
+#endif
+}
+#endif // def ZW__SYNC_WRITEBACK
+
+static void zw__fd_stream_writeback(zw__fd_stream* state) {
+#ifdef ZW__SYNC_WRITEBACK
+	// start writeback for the latest chunk and wait for the one before it, so the page cache
+	// holds at most a couple of chunks of dirty data for this file
+	if (state->sync_writeback && state->position - state->synced >= zw__fd_writeback_bytes) {
+		zw__sync_file_range(state->fd, state->synced, state->position - state->synced, zw__sync_write);
+		if (state->synced > state->settled) {
+			zw__sync_file_range(state->fd, state->settled, state->synced - state->settled,
+				zw__sync_wait_before | zw__sync_write | zw__sync_wait_after);
+			state->settled = state->synced;
+		}
+		state->synced = state->position;
+	}
+#else
+	(void)state;
+#endif // def ZW__SYNC_WRITEBACK
 }
 
-static zw_bool zw__zip_end_file(zw_zip archive) {
-	zw__zip_data_descriptor data_desc;
-	zw__zip_central_dir_file_header central_header;
-	zw__zip_info64 info64;
+// Asynchronous writes go to explicit offsets and leave the file position alone,
+// so it has to be brought up to date before any synchronous write
+static void zw__fd_stream_seek(zw__fd_stream* state) {
+	if (state->uring)
+		lseek(state->fd, (off_t)state->position, SEEK_SET);
+}
 
-	if (!archive || !archive->current_file.name_length)
-		return zw_false;
+static void zw__fd_stream_advance(zw_output_stream* stream, size_t written, size_t size) {
+	zw__fd_stream* state = (zw__fd_stream*)stream->user_data;
 
-	zw__flush_input(archive);
-	zw__zlib_huff(256); // end of block
+	state->position += written;
+	if (written != size)
+		stream->error = errno ? errno : 1;
+	zw__fd_stream_writeback(state);
+}
 
-	// pad with 0 bits to byte boundary
-	while (archive->bitcount)
-		zw__zlib_add(0,1);
-	zw__flush_compressed_bytes(archive);
+#ifdef ZW__IO_URING
 
-	data_desc.crc                               = archive->current_file.crc;
-	data_desc.compressed_size                   = ~(zw_u32)0;
-	data_desc.uncompressed_size                 = ~(zw_u32)0;
-	if (!zw__write_to_stream(archive, &data_desc, sizeof(data_desc)))
-		return zw_false;
+// Minimal io_uring driver (raw syscalls, no liburing): one writev per submitted output buffer.
+// The writer fills one buffer while up to max_buffers others are in flight.
 
-	central_header.signature                    = zw__zip_sig_central_dir_file_header;
-	central_header.spec_version                 = 45;
-	central_header.file_system                  = zw__zip_file_system_fat;
-	central_header.required_version             = 45;
-	central_header.flags                        = zw__zip_flag_has_data_desc;
-	central_header.compression_method           = zw__zip_compression_method_deflate;
-	central_header.file_time                    = archive->time;
-	central_header.file_date                    = archive->date;
-	central_header.crc                          = archive->current_file.crc;
-	central_header.compressed_size              = ~(zw_u32)0;
-	central_header.uncompressed_size            = ~(zw_u32)0;
-	central_header.file_name_length             = archive->current_file.name_length;
-	central_header.extra_field_length           = sizeof(zw__zip_info64);
-	central_header.file_comment_length          = 0;
-	central_header.start_disk                   = 0;
-	central_header.internal_attributes          = 0;
-	central_header.external_attributes          = 0;
-	central_header.local_header_relative_offset = ~(zw_u32)0;
-	if (!zw__append_to_central_dir(archive, &central_header, sizeof(central_header)))
-		return zw_false;
-	if (!zw__append_to_central_dir(archive, archive->current_file.name, central_header.file_name_length))
-		return zw_false;
-	
-	info64.header.id                            = zw__zip_info64_id;
-	info64.header.length                        = sizeof(info64) - sizeof(info64.header);
-	info64.compressed_size                      = archive->current_file.compressed_size;
-	info64.uncompressed_size                    = archive->current_file.uncompressed_size;
-	info64.local_header_relative_offset         = archive->current_file.start_offset;
-	if (!zw__append_to_central_dir(archive, &info64, sizeof(info64)))
-		return zw_false;
+enum {
+	zw__uring_max_buffers   = 8,
+};
 
-	archive->current_file.name_length = 0;
+struct zw__uring {
+	int                 ring_fd;
+	unsigned*           sq_tail;
+	unsigned*           sq_mask;
+	unsigned*           sq_array;
+	unsigned*           cq_head;
+	unsigned*           cq_tail;
+	unsigned*           cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void*               sq_ring;
+	void*               cq_ring;
+	size_t              sq_ring_size;
+	size_t              cq_ring_size;
+	size_t              sqes_size;
 
-	return zw_true;
-}
+	struct {
+	    struct iovec    iov;
+	    zw_u64          offset;
+	    zw_bool         busy;
+	}                   slots[zw__uring_max_buffers];
+	int                 in_flight;
+	int                 max_buffers;
+
+	void*               idle[zw__uring_max_buffers + 1];
+	int                 num_idle;
+	void*               owned[zw__uring_max_buffers];
+	int                 num_owned;
+	size_t              owned_bytes;
+	zw_allocator        allocator;
+};
 
-zw_bool zw_begin_file(zw_zip archive, const char* file_path) {
-	zw__zip_local_file_header local_header;
-	size_t name_length, name_capacity;
-	zw_u64 offset;
+static void zw__uring_destroy(zw__uring* ring) {
+	zw_allocator allocator = ring->allocator;
 	int i;
+	for (i = 0; i < ring->num_owned; ++i)
+		zw__free(&allocator, ring->owned[i], ring->owned_bytes);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->ring_fd >= 0)
+		close(ring->ring_fd);
+	zw__free(&allocator, ring, sizeof(zw__uring));
+}
 
-	if (!archive)
-		return zw_false;
-	zw__zip_end_file(archive);
+// MAP_POPULATE (Linux only) just saves the first page faults on the rings
+#ifdef MAP_POPULATE
+	#define ZW__MAP_RING (MAP_SHARED | MAP_POPULATE)
+#else
+	#define ZW__MAP_RING MAP_SHARED
+#endif
 
-	if (!file_path || !*file_path)
-		return zw_false;
+static zw__uring* zw__uring_create(int max_buffers, const zw_allocator* allocator) {
+	struct io_uring_params params;
+	zw__uring* ring;
+	zw_u8* sq;
+	zw_u8* cq;
 
-	name_length = strlen(file_path);
-	if (name_length > 0xfffe)
-		name_length = 0xfffe;
-	offset = archive->offset;
+	ring = (zw__uring*) zw__alloc(allocator, sizeof(zw__uring));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, sizeof(*ring));
+	ring->allocator = *allocator;
+	ring->max_buffers = max_buffers < 2 ? 2 : max_buffers > zw__uring_max_buffers ? zw__uring_max_buffers : max_buffers;
+
+	memset(&params, 0, sizeof(params));
+	ring->ring_fd = (int)syscall(__NR_io_uring_setup, (unsigned)zw__uring_max_buffers, &params);
+	if (ring->ring_fd < 0) {
+		// e.g. old kernel, or disabled by a seccomp policy
+		zw__free(allocator, ring, sizeof(zw__uring));
+		return NULL;
+	}
 
-	local_header.signature              = zw__zip_sig_local_file_header;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, ZW__MAP_RING, ring->ring_fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		zw__uring_destroy(ring);
+		return NULL;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, ZW__MAP_RING, ring->ring_fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			zw__uring_destroy(ring);
+			return NULL;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, ZW__MAP_RING, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		zw__uring_destroy(ring);
+		return NULL;
+	}
+
+	sq = (zw_u8*)ring->sq_ring;
+	cq = (zw_u8*)ring->cq_ring;
+	ring->sq_tail  = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask  = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->cq_head  = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail  = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask  = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	return ring;
+}
+
+static int zw__uring_enter(zw__uring* ring, unsigned to_submit, unsigned min_complete) {
+	for (;;) {
+		long result = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, min_complete,
+		                      min_complete ? IORING_ENTER_GETEVENTS : 0u, NULL, 0);
+		if (result >= 0 || errno != EINTR)
+			return result < 0 ? errno : 0;
+	}
+}
+
+// Retires one completed write, optionally waiting for it. Returns zw_false if there was nothing to retire.
+static zw_bool zw__uring_reap(zw_output_stream* stream, zw_bool wait) {
+	zw__fd_stream* state = (zw__fd_stream*)stream->user_data;
+	zw__uring* ring = state->uring;
+	struct io_uring_cqe* cqe;
+	unsigned head;
+	size_t done;
+	int slot, error;
+
+	for (;;) {
+		head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		if (!wait || !ring->in_flight)
+			return zw_false;
+		error = zw__uring_enter(ring, 0, 1);
+		if (error) {
+			if (!stream->error)
+				stream->error = error;
+			return zw_false;
+		}
+	}
+
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	slot = (int)cqe->user_data;
+	if (cqe->res < 0) {
+		if (!stream->error)
+			stream->error = -cqe->res;
+	} else if ((size_t)cqe->res < ring->slots[slot].iov.iov_len) {
+		// short write, finish it synchronously
+		done = (size_t)cqe->res;
+		while (done < ring->slots[slot].iov.iov_len) {
+			ssize_t result = pwrite(state->fd, (const zw_u8*)ring->slots[slot].iov.iov_base + done,
+			                        ring->slots[slot].iov.iov_len - done, (off_t)(ring->slots[slot].offset + done));
+			if (result <= 0) {
+				if (!stream->error)
+					stream->error = errno ? errno : 1;
+				break;
+			}
+			done += (size_t)result;
+		}
+	}
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	ring->slots[slot].busy = zw_false;
+	ring->idle[ring->num_idle++] = ring->slots[slot].iov.iov_base;
+	ring->in_flight--;
+
+	return zw_true;
+}
+
+static void* zw__submit_fd_stream(zw_output_stream* stream, void* buf, size_t size, size_t capacity) {
+	zw__fd_stream* state = (zw__fd_stream*)stream->user_data;
+	zw__uring* ring = state->uring;
+	struct io_uring_sqe* sqe;
+	unsigned tail, index;
+	void* next = NULL;
+	int slot, error;
+
+	// get the next buffer first, so failing leaves buf with the caller
+	while (ring->num_idle == 0 && zw__uring_reap(stream, zw_false))
+		;
+	if (ring->num_idle > 0) {
+		next = ring->idle[--ring->num_idle];
+	} else if (ring->num_owned < ring->max_buffers) {
+		next = zw__alloc(&ring->allocator, capacity);
+		if (next) {
+			ring->owned[ring->num_owned++] = next;
+			ring->owned_bytes = capacity;
+		}
+	}
+	while (!next) {
+		if (!zw__uring_reap(stream, zw_true))
+			return NULL;
+		next = ring->idle[--ring->num_idle];
+	}
+
+	// next is not in flight, so neither are all max_buffers + 1 buffers: a slot is free
+	for (slot = 0; ring->slots[slot].busy; ++slot)
+		;
+	ring->slots[slot].iov.iov_base  = buf;
+	ring->slots[slot].iov.iov_len   = size;
+	ring->slots[slot].offset        = state->position;
+	ring->slots[slot].busy          = zw_true;
+
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode     = IORING_OP_WRITEV;
+	sqe->fd         = state->fd;
+	sqe->addr       = (unsigned long long)(size_t)&ring->slots[slot].iov;
+	sqe->len        = 1;
+	sqe->off        = state->position;
+	sqe->user_data  = (unsigned long long)slot;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->in_flight++;
+
+	error = zw__uring_enter(ring, 1, 0);
+	if (error && !stream->error)
+		stream->error = error;
+
+	state->position += size;
+	zw__fd_stream_writeback(state);
+
+	return next;
+}
+
+#endif // def ZW__IO_URING
+
+static size_t zw__write_fd_stream(zw_output_stream* stream, const void* data, size_t size) {
+	zw__fd_stream* state = (zw__fd_stream*)stream->user_data;
+	size_t written;
+	zw__fd_stream_seek(state);
+	written = zw__write_fd(state->fd, data, size);
+	zw__fd_stream_advance(stream, written, size);
+	return written;
+}
+
+static size_t zw__writev_fd_stream(zw_output_stream* stream, const zw_iovec* iov, int count) {
+	zw__fd_stream* state = (zw__fd_stream*)stream->user_data;
+	size_t written, size = 0;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		size += iov[i].size;
+	zw__fd_stream_seek(state);
+	written = zw__writev_fd(state->fd, iov, count);
+	zw__fd_stream_advance(stream, written, size);
+
+	return written;
+}
+
+#ifdef ZW__ZERO_COPY
+static size_t zw__copy_fd_fd_stream(zw_output_stream* stream, int src_fd, unsigned long long offset, size_t size) {
+	zw__fd_stream* state = (zw__fd_stream*)stream->user_data;
+	size_t copied;
+	zw__fd_stream_seek(state);
+	copied = zw__copy_fd_to_fd(state->fd, src_fd, offset, size);
+	state->position += copied;
+	return copied;
+}
+#endif // def ZW__ZERO_COPY
+
+static void zw__close_fd_stream(zw_output_stream* stream) {
+	zw__fd_stream* state = (zw__fd_stream*)stream->user_data;
+	if (!state)
+		return;
+
+#ifdef ZW__IO_URING
+	if (state->uring) {
+		while (zw__uring_reap(stream, zw_true))
+			;
+		zw__uring_destroy(state->uring);
+	}
+#endif // def ZW__IO_URING
+
+	if (state->preallocated > state->position && ftruncate(state->fd, (off_t)state->position) != 0 && !stream->error)
+		stream->error = errno;
+	if (close(state->fd) != 0 && !stream->error)
+		stream->error = errno;
+
+	zw__free(&state->allocator, state, sizeof(zw__fd_stream));
+	stream->user_data = NULL;
+}
+
+static zw_bool zw__open_fd_stream(zw_output_stream* stream, const zw_zip_options* options) {
+	zw_allocator allocator;
+	zw__fd_stream* state;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+#ifdef O_CLOEXEC
+	flags |= O_CLOEXEC;
+#endif
+
+	allocator = zw__options_allocator(&options->allocator);
+	state = (zw__fd_stream*) zw__alloc(&allocator, sizeof(zw__fd_stream));
+	if (!state)
+		return zw_false;
+	memset(state, 0, sizeof(*state));
+	state->allocator = allocator;
+	state->sync_writeback = options->sync_writeback;
+
+	state->fd = open(options->file_path, flags, 0666);
+	if (state->fd < 0) {
+		zw__free(&allocator, state, sizeof(zw__fd_stream));
+		return zw_false;
+	}
+
+#ifdef __linux__
+	// reserves the blocks up front (less fragmentation, early ENOSPC); the extra size is trimmed on close
+	if (options->expected_size && posix_fallocate(state->fd, 0, (off_t)options->expected_size) == 0)
+		state->preallocated = options->expected_size;
+#endif
+
+	memset(stream, 0, sizeof(*stream));
+	stream->user_data           = state;
+	stream->write               = &zw__write_fd_stream;
+	stream->writev              = &zw__writev_fd_stream;
+	stream->close               = &zw__close_fd_stream;
+#ifdef ZW__ZERO_COPY
+	stream->copy_fd             = &zw__copy_fd_fd_stream;
+#endif
+#ifdef ZW__IO_URING
+	// without io_uring this stays a plain synchronous stream
+	if (options->async_buffers > 0) {
+		state->uring = zw__uring_create(options->async_buffers, &allocator);
+		if (state->uring)
+			stream->submit = &zw__submit_fd_stream;
+	}
+#endif
+
+	return zw_true;
+}
+
+#endif // def ZW__POSIX
+
+// Pipeline stream /////////////////////////////////////////////
+// Wraps another stream. Filled output buffers go through a single-producer/single-consumer ring
+// to a background thread that writes them out. Handoffs only move the atomic ring indices: a side that
+// finds the ring empty (writer thread) or full (archive thread) raises its waiting flag and sleeps, and
+// the other side takes the lock to wake it only when it sees the flag after moving its own index.
+// Both sides store, then load, sequentially consistent, so at least one sees the other and no wakeup is missed.
+
+#ifdef ZW__THREADS
+
+enum {
+	zw__pipeline_max_buffers = 16,
+};
+
+typedef struct {
+	zw_output_stream    inner;
+	zw__thread          thread;
+	zw__mutex           mutex;
+	zw__cond            not_empty;      // the writer thread sleeps on these
+	zw__cond            not_full;       // and the archive thread on these
+	unsigned            writer_waiting;
+	unsigned            archive_waiting;
+	unsigned            num_slots;
+	unsigned            head;           // next slot to write out, advanced by the writer thread
+	unsigned            tail;           // next slot to fill, advanced by the archive thread
+	unsigned            done;           // set under the mutex
+	unsigned            error;          // inner.error, published by the writer thread
+	struct {
+	    void*           buf;            // once written out, recycled as the next buffer to fill
+	    size_t          size;
+	}                   slots[zw__pipeline_max_buffers];
+	void*               owned[zw__pipeline_max_buffers];
+	unsigned            num_owned;
+	size_t              owned_bytes;
+	zw_allocator        allocator;
+} zw__pipeline;
+
+ZW__THREAD_PROC(zw__pipeline_run) {
+	zw__pipeline* pipeline = (zw__pipeline*)arg;
+	unsigned head = pipeline->head;
+
+	for (;;) {
+		if (zw__load_acquire(&pipeline->tail) == head) {
+			zw__mutex_lock(&pipeline->mutex);
+			zw__store_seq_cst(&pipeline->writer_waiting, 1);
+			while (zw__load_seq_cst(&pipeline->tail) == head && !pipeline->done)
+				zw__cond_wait(&pipeline->not_empty, &pipeline->mutex);
+			zw__store_release(&pipeline->writer_waiting, 0);
+			zw__mutex_unlock(&pipeline->mutex);
+			if (zw__load_acquire(&pipeline->tail) == head)
+				break; // done, and nothing left
+		}
+
+		// after an error, keep draining (without writing) so the archive thread never blocks
+		if (!pipeline->inner.error) {
+			size_t size = pipeline->slots[head % pipeline->num_slots].size;
+			if (pipeline->inner.write(&pipeline->inner, pipeline->slots[head % pipeline->num_slots].buf, size) != size &&
+				!pipeline->inner.error)
+				pipeline->inner.error = 1;
+			if (pipeline->inner.error)
+				zw__store_release(&pipeline->error, (unsigned)pipeline->inner.error);
+		}
+
+		zw__store_seq_cst(&pipeline->head, ++head);
+		if (zw__load_seq_cst(&pipeline->archive_waiting)) {
+			zw__mutex_lock(&pipeline->mutex);
+			zw__cond_signal(&pipeline->not_full);
+			zw__mutex_unlock(&pipeline->mutex);
+		}
+	}
+
+	ZW__THREAD_RETURN;
+}
+
+static void zw__pipeline_publish_error(zw_output_stream* stream) {
+	zw__pipeline* pipeline = (zw__pipeline*)stream->user_data;
+	unsigned error = zw__load_acquire(&pipeline->error);
+	if (error && !stream->error)
+		stream->error = (int)error;
+}
+
+// Archive thread: waits until the writer thread has taken slots up to tail - max_pending
+static void zw__pipeline_wait(zw__pipeline* pipeline, unsigned max_pending) {
+	if (pipeline->tail - zw__load_acquire(&pipeline->head) <= max_pending)
+		return;
+
+	zw__mutex_lock(&pipeline->mutex);
+	zw__store_seq_cst(&pipeline->archive_waiting, 1);
+	while (pipeline->tail - zw__load_seq_cst(&pipeline->head) > max_pending)
+		zw__cond_wait(&pipeline->not_full, &pipeline->mutex);
+	zw__store_release(&pipeline->archive_waiting, 0);
+	zw__mutex_unlock(&pipeline->mutex);
+}
+
+// Waits until the writer thread is idle, after which the inner stream can be used directly
+static void zw__pipeline_drain(zw_output_stream* stream) {
+	zw__pipeline_wait((zw__pipeline*)stream->user_data, 0);
+	zw__pipeline_publish_error(stream);
+}
+
+static void* zw__submit_pipeline(zw_output_stream* stream, void* buf, size_t size, size_t capacity) {
+	zw__pipeline* pipeline = (zw__pipeline*)stream->user_data;
+	unsigned tail = pipeline->tail;
+	unsigned slot = tail % pipeline->num_slots;
+	void* next;
+
+	zw__pipeline_wait(pipeline, pipeline->num_slots - 1);
+
+	next = pipeline->slots[slot].buf;
+	if (!next) {
+		next = zw__alloc(&pipeline->allocator, capacity);
+		if (!next)
+			return NULL;
+		pipeline->owned[pipeline->num_owned++] = next;
+		pipeline->owned_bytes = capacity;
+	}
+	pipeline->slots[slot].buf = buf;
+	pipeline->slots[slot].size = size;
+
+	zw__store_seq_cst(&pipeline->tail, tail + 1);
+	if (zw__load_seq_cst(&pipeline->writer_waiting)) {
+		zw__mutex_lock(&pipeline->mutex);
+		zw__cond_signal(&pipeline->not_empty);
+		zw__mutex_unlock(&pipeline->mutex);
+	}
+
+	zw__pipeline_publish_error(stream);
+	return next;
+}
+
+static size_t zw__write_pipeline(zw_output_stream* stream, const void* data, size_t size) {
+	zw__pipeline* pipeline = (zw__pipeline*)stream->user_data;
+	size_t written;
+
+	zw__pipeline_drain(stream);
+	if (stream->error)
+		return 0;
+	written = pipeline->inner.write(&pipeline->inner, data, size);
+	if (pipeline->inner.error)
+		stream->error = pipeline->inner.error;
+
+	return written;
+}
+
+static size_t zw__writev_pipeline(zw_output_stream* stream, const zw_iovec* iov, int count) {
+	zw__pipeline* pipeline = (zw__pipeline*)stream->user_data;
+	size_t written;
+
+	zw__pipeline_drain(stream);
+	if (stream->error)
+		return 0;
+	written = pipeline->inner.writev(&pipeline->inner, iov, count);
+	if (pipeline->inner.error)
+		stream->error = pipeline->inner.error;
+
+	return written;
+}
+
+static size_t zw__copy_fd_pipeline(zw_output_stream* stream, int src_fd, unsigned long long offset, size_t size) {
+	zw__pipeline* pipeline = (zw__pipeline*)stream->user_data;
+	size_t copied;
+
+	zw__pipeline_drain(stream);
+	if (stream->error)
+		return 0;
+	copied = pipeline->inner.copy_fd(&pipeline->inner, src_fd, offset, size);
+	if (pipeline->inner.error)
+		stream->error = pipeline->inner.error;
+
+	return copied;
+}
+
+static void zw__flush_pipeline(zw_output_stream* stream) {
+	zw__pipeline* pipeline = (zw__pipeline*)stream->user_data;
+
+	zw__pipeline_drain(stream);
+	if (pipeline->inner.flush && !stream->error) {
+		pipeline->inner.flush(&pipeline->inner);
+		if (pipeline->inner.error)
+			stream->error = pipeline->inner.error;
+	}
+}
+
+static void zw__close_pipeline(zw_output_stream* stream) {
+	zw__pipeline* pipeline = (zw__pipeline*)stream->user_data;
+	unsigned i;
+
+	zw__mutex_lock(&pipeline->mutex);
+	pipeline->done = 1;
+	zw__cond_signal(&pipeline->not_empty);
+	zw__mutex_unlock(&pipeline->mutex);
+	zw__thread_join(pipeline->thread);
+
+	if (pipeline->inner.close)
+		pipeline->inner.close(&pipeline->inner);
+	if (pipeline->inner.error && !stream->error)
+		stream->error = pipeline->inner.error;
+
+	for (i = 0; i < pipeline->num_owned; ++i)
+		zw__free(&pipeline->allocator, pipeline->owned[i], pipeline->owned_bytes);
+	zw__cond_destroy(&pipeline->not_full);
+	zw__cond_destroy(&pipeline->not_empty);
+	zw__mutex_destroy(&pipeline->mutex);
+	zw__free(&pipeline->allocator, pipeline, sizeof(zw__pipeline));
+	stream->user_data = NULL;
+}
+
+// Replaces *stream with a pipeline stream that forwards to it; leaves it alone on failure
+static zw_bool zw__open_pipeline(zw_output_stream* stream, int num_buffers, const zw_allocator* allocator) {
+	zw__pipeline* pipeline = (zw__pipeline*) zw__alloc(allocator, sizeof(zw__pipeline));
+	if (!pipeline)
+		return zw_false;
+
+	memset(pipeline, 0, sizeof(*pipeline));
+	pipeline->allocator = *allocator;
+	pipeline->inner = *stream;
+	pipeline->num_slots = num_buffers > zw__pipeline_max_buffers ? (unsigned)zw__pipeline_max_buffers : (unsigned)num_buffers;
+	zw__mutex_init(&pipeline->mutex);
+	zw__cond_init(&pipeline->not_empty);
+	zw__cond_init(&pipeline->not_full);
+	if (!zw__thread_start(&pipeline->thread, &zw__pipeline_run, pipeline)) {
+		zw__cond_destroy(&pipeline->not_full);
+		zw__cond_destroy(&pipeline->not_empty);
+		zw__mutex_destroy(&pipeline->mutex);
+		zw__free(allocator, pipeline, sizeof(zw__pipeline));
+		return zw_false;
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	stream->user_data           = pipeline;
+	stream->write               = &zw__write_pipeline;
+	stream->close               = &zw__close_pipeline;
+	stream->submit              = &zw__submit_pipeline;
+	stream->flush               = &zw__flush_pipeline;
+	stream->error               = pipeline->inner.error;
+	if (pipeline->inner.writev)
+		stream->writev          = &zw__writev_pipeline;
+	if (pipeline->inner.copy_fd)
+		stream->copy_fd         = &zw__copy_fd_pipeline;
+
+	return zw_true;
+}
+
+#endif // def ZW__THREADS
+
+// Source files ////////////////////////////////////////////////
+
+static zw_bool zw__file_size(FILE* file, zw_u64* size) {
+#if defined(ZW__POSIX)
+	struct stat info;
+	if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode))
+		return zw_false;
+	*size = (zw_u64)info.st_size;
+#elif defined(_MSC_VER)
+	__int64 end;
+	if (_fseeki64(file, 0, SEEK_END) != 0 || (end = _ftelli64(file)) < 0)
+		return zw_false;
+	*size = (zw_u64)end;
+#else
+	long end;
+	if (fseek(file, 0, SEEK_END) != 0 || (end = ftell(file)) < 0)
+		return zw_false;
+	*size = (zw_u64)end;
+#endif
+	return zw_true;
+}
+
+// Note: the window and input buffer double as a scratch buffer (40 KB with low_memory, 64 KB otherwise),
+// so these must only be called between entries
+
+// Computes the crc32 and, optionally, the content hash of the whole file
+static zw_bool zw__scan_file(zw_zip archive, FILE* file, zw_u64 size, zw_u32* crc, zw_u64* hash) {
+	const size_t scratch_bytes = 32768 + archive->deflate.in_total;
+	zw_u64 offset = 0;
+
+	*crc = 0;
+	if (hash)
+		*hash = 0;
+
+#ifdef ZW__POSIX
+	if (size > 0 && size <= (zw_u64)(size_t)-1) {
+		void* view = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+		if (view != MAP_FAILED) {
+#ifdef POSIX_MADV_SEQUENTIAL
+			posix_madvise(view, (size_t)size, POSIX_MADV_SEQUENTIAL);
+#endif
+			*crc = zw__crc32((const zw_u8*)view, (size_t)size, 0);
+			if (hash)
+				*hash = zw__hash64((const zw_u8*)view, (size_t)size, 0);
+			munmap(view, (size_t)size);
+			return zw_true;
+		}
+	}
+#endif // def ZW__POSIX
+
+	if (zw__fseek64(file, 0) != 0)
+		return zw_false;
+	while (offset < size) {
+		size_t batch = size - offset < scratch_bytes ? (size_t)(size - offset) : scratch_bytes;
+		if (fread(archive->deflate.window, 1, batch, file) != batch)
+			return zw_false;
+		*crc = zw__crc32(archive->deflate.window, batch, *crc);
+		if (hash)
+			*hash = zw__hash64(archive->deflate.window, batch, *hash);
+		offset += batch;
+	}
+
+	return zw_true;
+}
+
+static zw_bool zw__copy_file_data(zw_zip archive, FILE* file, zw_u64 offset, zw_u64 size) {
+	const size_t scratch_bytes = 32768 + archive->deflate.in_total;
+
+#ifdef ZW__POSIX
+	// let the stream move the bytes without a round-trip through our buffers, if it can
+	zw_bool copy_fd = archive->stream.copy_fd ? zw_true : zw_false;
+	if (copy_fd && size > 0 && !zw__flush_output(archive))
+		return zw_false;
+	if (zw__sbcount(archive->pending) > 0)
+		copy_fd = zw_false; // would jump ahead of the output that is still waiting
+	while (copy_fd && size > 0 && !archive->stream.error) {
+		size_t batch = size < 0x40000000u ? (size_t)size : 0x40000000u;
+		size_t copied = archive->stream.copy_fd(&archive->stream, fileno(file), offset, batch);
+		archive->offset += copied;
+		offset += copied;
+		size -= copied;
+		if (copied < batch)
+			break;
+	}
+#endif // def ZW__POSIX
+
+	if (archive->stream.error)
+		return zw_false;
+	if (size > 0 && zw__fseek64(file, offset) != 0)
+		return zw_false;
+	while (size > 0) {
+		size_t batch = size < scratch_bytes ? (size_t)size : scratch_bytes;
+		if (fread(archive->deflate.window, 1, batch, file) != batch)
+			return zw_false;
+		if (!zw__write_output(archive, archive->deflate.window, batch))
+			return zw_false;
+		size -= batch;
+	}
+
+	return zw_true;
+}
+
+// Existing archives //////////////////////////////////////////
+
+typedef struct {
+	zw_u64              local_header_offset;
+	zw_u64              compressed_size;
+	zw_u64              uncompressed_size;
+	zw_u32              crc;
+	zw_u16              method;
+	zw_u16              flags;
+	size_t              name;           // offset in names
+	size_t              record;         // offset of the central directory record in central_dir
+} zw__source_entry;
+
+typedef struct zw__source_details {
+	FILE*               file;
+	zw__source_entry*   entries;
+	char*               names;
+	zw_u8*              central_dir;    // kept, so copied entries can carry their records over
+} zw__source_details;
+
+typedef struct {
+	zw_u64              offset;
+	zw_u64              size;
+	zw_u64              count;
+} zw__zip_central_dir_location;
+
+static zw_bool zw__read_at(FILE* file, zw_u64 offset, void* data, size_t size) {
+	if (zw__fseek64(file, offset) != 0)
+		return zw_false;
+	return fread(data, 1, size, file) == size ? zw_true : zw_false;
+}
+
+static zw_bool zw__zip_locate_central_dir(FILE* file, zw__zip_central_dir_location* location) {
+	zw__zip_end_of_central_dir eocd;
+	zw__zip_end_of_central_dir_locator_64 eocdloc64;
+	zw__zip_end_of_central_dir_64 eocd64;
+	const size_t max_tail_size = sizeof(eocd) + 0xffff;
+	zw_u64 file_size, tail_offset, eocd_offset;
+	size_t tail_size, i;
+	zw_bool found = zw_false;
+	zw_u8* tail;
+
+	if (!zw__file_size(file, &file_size) || file_size < sizeof(eocd))
+		return zw_false;
+
+	tail_size = file_size < max_tail_size ? (size_t)file_size : max_tail_size;
+	tail_offset = file_size - tail_size;
+	tail = (zw_u8*) ZW_MALLOC(tail_size);
+	if (!tail)
+		return zw_false;
+
+	// scan backwards for an end of central directory record whose comment ends exactly at the end of the file
+	if (zw__read_at(file, tail_offset, tail, tail_size)) {
+		for (i = tail_size - sizeof(eocd) + 1; i-- > 0; ) {
+			memcpy(&eocd, tail + i, sizeof(eocd));
+			if (eocd.signature == zw__zip_sig_eocd && i + sizeof(eocd) + eocd.comment_length == tail_size) {
+				found = zw_true;
+				break;
+			}
+		}
+	}
+	ZW_FREE(tail);
+	if (!found)
+		return zw_false;
+
+	eocd_offset = tail_offset + i;
+	location->offset = eocd.central_dir_offset;
+	location->size   = eocd.central_dir_size;
+	location->count  = eocd.num_central_dir_recs_total;
+
+	if (eocd_offset >= sizeof(eocdloc64) &&
+		zw__read_at(file, eocd_offset - sizeof(eocdloc64), &eocdloc64, sizeof(eocdloc64)) &&
+		eocdloc64.signature == zw__zip_sig_eocdloc64)
+	{
+		if (!zw__read_at(file, eocdloc64.end_of_central_dir_64_offset, &eocd64, sizeof(eocd64)) ||
+			eocd64.signature != zw__zip_sig_eocd64)
+			return zw_false;
+		location->offset = eocd64.central_dir_offset;
+		location->size   = eocd64.central_dir_size;
+		location->count  = eocd64.num_central_dir_recs_total;
+	}
+
+	if (location->offset > eocd_offset || location->size > eocd_offset - location->offset)
+		return zw_false;
+	return zw_true;
+}
+
+static zw_bool zw__source_parse_central_dir(zw_source source, const zw_u8* data, size_t size, zw_u64 count) {
+	zw__zip_central_dir_file_header header;
+	zw__zip_extra_header extra;
+	zw__source_entry entry;
+	size_t pos = 0, extra_pos, extra_end, field;
+	zw_u64 i;
+
+	for (i = 0; i < count; ++i) {
+		if (size - pos < sizeof(header))
+			return zw_false;
+		memcpy(&header, data + pos, sizeof(header));
+		if (header.signature != zw__zip_sig_central_dir_file_header)
+			return zw_false;
+		entry.record = pos;
+		pos += sizeof(header);
+		if (size - pos < (size_t)header.file_name_length + header.extra_field_length + header.file_comment_length)
+			return zw_false;
+
+		entry.local_header_offset   = header.local_header_relative_offset;
+		entry.compressed_size       = header.compressed_size;
+		entry.uncompressed_size     = header.uncompressed_size;
+		entry.crc                   = header.crc;
+		entry.method                = header.compression_method;
+		entry.flags                 = header.flags;
+		entry.name                  = zw__sbcount(source->names);
+
+		// zw__zip_info64 fields are only present for the values that overflowed, in order
+		extra_pos = pos + header.file_name_length;
+		extra_end = extra_pos + header.extra_field_length;
+		while (extra_end - extra_pos >= sizeof(extra)) {
+			memcpy(&extra, data + extra_pos, sizeof(extra));
+			extra_pos += sizeof(extra);
+			if (extra.length > extra_end - extra_pos)
+				break;
+			if (extra.id == zw__zip_info64_id) {
+				field = extra_pos;
+				if (header.uncompressed_size == ~(zw_u32)0 && field + 8 <= extra_pos + extra.length) {
+					memcpy(&entry.uncompressed_size, data + field, 8);
+					field += 8;
+				}
+				if (header.compressed_size == ~(zw_u32)0 && field + 8 <= extra_pos + extra.length) {
+					memcpy(&entry.compressed_size, data + field, 8);
+					field += 8;
+				}
+				if (header.local_header_relative_offset == ~(zw_u32)0 && field + 8 <= extra_pos + extra.length)
+					memcpy(&entry.local_header_offset, data + field, 8);
+			}
+			extra_pos += extra.length;
+		}
+
+		zw__sbmaybegrow(&zw__default_allocator, source->names, header.file_name_length + 1u);
+		ZW_MEMMOVE(source->names + entry.name, data + pos, header.file_name_length);
+		source->names[entry.name + header.file_name_length] = 0;
+		zw__sbn(source->names) += header.file_name_length + 1u;
+		zw__sbpush(&zw__default_allocator, source->entries, entry);
+
+		pos = extra_end + header.file_comment_length;
+	}
+
+	return zw_true;
+}
+
+zw_source zw_source_open(const char* file_path) {
+	zw__zip_central_dir_location location;
+	zw_source source;
+	zw_u8* central_dir;
+	zw_bool ok;
+
+	if (!file_path)
+		return NULL;
+
+	source = (zw_source) ZW_MALLOC(sizeof(zw__source_details));
+	if (!source)
+		return NULL;
+	memset(source, 0, sizeof(*source));
+
+	source->file = fopen(file_path, "rb");
+	if (!source->file || !zw__zip_locate_central_dir(source->file, &location) || location.size > (size_t)-1) {
+		zw_source_close(source);
+		return NULL;
+	}
+
+	central_dir = (zw_u8*) ZW_MALLOC(location.size ? (size_t)location.size : 1);
+	ok = zw_false;
+	if (central_dir) {
+		source->central_dir = central_dir;
+		if (zw__read_at(source->file, location.offset, central_dir, (size_t)location.size))
+			ok = zw__source_parse_central_dir(source, central_dir, (size_t)location.size, location.count);
+	}
+
+	if (!ok) {
+		zw_source_close(source);
+		return NULL;
+	}
+
+	return source;
+}
+
+size_t zw_source_count(zw_source source) {
+	return source ? zw__sbcount(source->entries) : 0;
+}
+
+const char* zw_source_name(zw_source source, size_t index) {
+	if (index >= zw_source_count(source))
+		return NULL;
+	return source->names + source->entries[index].name;
+}
+
+size_t zw_source_find(zw_source source, const char* file_path) {
+	size_t i, count = zw_source_count(source);
+	for (i = 0; i < count; ++i)
+		if (strcmp(source->names + source->entries[i].name, file_path) == 0)
+			return i;
+	return (size_t)-1;
+}
+
+void zw_source_close(zw_source source) {
+	if (!source)
+		return;
+	if (source->file)
+		fclose(source->file);
+	zw__sbfree(&zw__default_allocator, source->entries);
+	zw__sbfree(&zw__default_allocator, source->names);
+	if (source->central_dir)
+		ZW_FREE(source->central_dir);
+	ZW_FREE(source);
+}
+
+// Archive functionality ///////////////////////////////////////
+
+static zw_bool zw__spill_central_dir(zw_zip archive) {
+	size_t size = zw__sbcount(archive->central_dir);
+
+	if (!size)
+		return zw_true;
+	if (!archive->spill.file) {
+		archive->spill.file = tmpfile();
+		if (!archive->spill.file) {
+			archive->spill.limit = 0;  // no temporary files here, keep it all in memory then
+			return zw_true;
+		}
+	}
+	if (fwrite(archive->central_dir, 1, size, archive->spill.file) != size) {
+		if (!archive->stream.error)
+			archive->stream.error = 1;
+		return zw_false;
+	}
+	archive->spill.size += size;
+	zw__sbn(archive->central_dir) = 0;
+
+	return zw_true;
+}
+
+static void zw__close_spill(zw_zip archive) {
+	if (archive->spill.file)
+		fclose(archive->spill.file);
+	archive->spill.file = NULL;
+	archive->spill.size = 0;
+}
+
+static zw_bool zw__append_to_central_dir(zw_zip archive, const void* data, size_t size) {
+	if (!size)
+		return zw_true;
+	if (archive->spill.limit && zw__sbcount(archive->central_dir) + size > archive->spill.limit && !zw__spill_central_dir(archive))
+		return zw_false;
+	zw__sbmaybegrow(&archive->allocator, archive->central_dir, size);
+	ZW_MEMMOVE(archive->central_dir + zw__sbn(archive->central_dir), data, size);
+	zw__sbn(archive->central_dir) += size;
+	return zw_true;
+}
+
+#ifndef ZW__POSIX
+static zw_bool zw__open_stdio(zw_output_stream* stream, const char* file_path) {
+	FILE* file = fopen(file_path, "wb");
+	if (!file)
+		return zw_false;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->user_data           = file;
+	stream->write               = &zw__write_stdio;
+	stream->close               = &zw__close_stdio;
+	stream->flush               = &zw__flush_stdio;
+
+	return zw_true;
+}
+#endif // ndef ZW__POSIX
+
+zw_zip zw_create(const char* file_path) {
+	zw_zip_options options;
+
+	memset(&options, 0, sizeof(options));
+	options.file_path = file_path;
+
+	return zw_create_ex(&options);
+}
+
+enum {
+	zw__cache_line_size = 64,
+	zw__huge_page_size = 2 * 1024 * 1024,
+};
+
+// The archive's block is cache line aligned, like the window and output buffer inside it
+static zw_zip zw__zip_alloc(const zw_allocator* base, size_t size, zw_bool huge_pages) {
+	zw_u8* block = NULL;
+	size_t block_bytes = size + zw__cache_line_size - 1;
+	zw_zip archive;
+
+#ifdef ZW__HUGE_PAGES
+	if (huge_pages) {
+		// over-map, then trim to a 2 MB aligned range the kernel can back with huge pages
+		size_t mapped_bytes = ZW_ROUND_UP(size, zw__huge_page_size) + zw__huge_page_size;
+		zw_u8* mapped = (zw_u8*) mmap(NULL, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped != (zw_u8*)MAP_FAILED) {
+			block = (zw_u8*) ZW_ROUND_UP((size_t)mapped, zw__huge_page_size);
+			block_bytes = ZW_ROUND_UP(size, zw__huge_page_size);
+			if (block > mapped)
+				munmap(mapped, (size_t)(block - mapped));
+			if (mapped + mapped_bytes > block + block_bytes)
+				munmap(block + block_bytes, (size_t)(mapped + mapped_bytes - block - block_bytes));
+			madvise(block, block_bytes, MADV_HUGEPAGE);
+		}
+	}
+#else
+	(void)huge_pages;
+#endif
+
+	huge_pages = block ? zw_true : zw_false;
+	if (!block)
+		block = (zw_u8*) zw__alloc(base, block_bytes);
+	if (!block)
+		return NULL;
+
+	archive = (zw_zip) ZW_ROUND_UP((size_t)block, zw__cache_line_size);
+	memset(archive, 0, sizeof(zw__zip_details));
+	archive->block = block;
+	archive->block_bytes = block_bytes;
+	archive->huge_pages = huge_pages;
+
+	return archive;
+}
+
+static void zw__zip_free(zw_zip archive) {
+	zw_allocator base = archive->base;
+	void* block = archive->block;
+	size_t block_bytes = archive->block_bytes;
+
+	zw__free_chains(&archive->deflate);
+	if (archive->current_file.name != archive->current_file.name_buf)
+		zw__sbfree(&archive->allocator, archive->current_file.name);
+	zw__sbfree(&archive->allocator, archive->cache.dir);
+	zw__sbfree(&archive->allocator, archive->central_dir);
+	zw__sbfree(&archive->allocator, archive->pending);
+	zw__close_spill(archive);
+
+	zw__arena_release(&archive->arena);
+#ifdef ZW__HUGE_PAGES
+	if (archive->huge_pages) {
+		munmap(block, block_bytes);
+		return;
+	}
+#endif
+	zw__free(&base, block, block_bytes);
+}
+
+// New entries overwrite the old central directory, which is kept in memory and written back
+// (together with the new entries) by zw_finish. The archive is unreadable until then.
+// The file is cut short after the new end record, so this fails where that isn't possible (neither POSIX nor MSVC).
+#ifdef ZW__TRUNCATE
+zw_zip zw_open_append(const char* file_path) {
+	zw__zip_central_dir_location location;
+	zw_zip_options options;
+	FILE* file;
+	zw_zip archive;
+	size_t central_dir_size;
+	zw_bool ok = zw_true;
+
+	file = fopen(file_path, "r+b");
+	if (!file)
+		return NULL;
+
+	if (!zw__zip_locate_central_dir(file, &location) || location.size > (size_t)-1) {
+		fclose(file);
+		return NULL;
+	}
+	central_dir_size = (size_t)location.size;
+
+	memset(&options, 0, sizeof(options));
+	options.stream.user_data    = file;
+	options.stream.write        = &zw__write_stdio;
+	options.stream.close        = &zw__close_stdio_truncate;
+	options.stream.flush        = &zw__flush_stdio;
+#ifdef ZW__POSIX
+	options.stream.writev       = &zw__writev_stdio;
+#endif
+#ifdef ZW__ZERO_COPY
+	options.stream.copy_fd      = &zw__copy_fd_stdio;
+#endif
+
+	archive = zw_create_ex(&options);
+	if (!archive) {
+		fclose(file);
+		return NULL;
+	}
+
+	if (central_dir_size) {
+		zw__sbgrow(&archive->allocator, archive->central_dir, central_dir_size);
+		ok = zw__read_at(file, location.offset, archive->central_dir, central_dir_size);
+		zw__sbn(archive->central_dir) = central_dir_size;
+	}
+
+	// continue writing where the central directory used to start
+	if (ok && zw__fseek64(file, location.offset) != 0)
+		ok = zw_false;
+
+	if (!ok) {
+		zw__zip_free(archive);
+		fclose(file);
+		return NULL;
+	}
+
+	archive->offset = location.offset;
+	archive->num_files = location.count;
+
+	return archive;
+}
+#else
+zw_zip zw_open_append(const char* file_path) {
+	(void)file_path;
+	return NULL;
+}
+#endif // def ZW__TRUNCATE
+
+// Opens the archive's output, and picks the output buffer size that suits it
+static zw_bool zw__open_output(zw_output_stream* stream, const zw_zip_options* options, size_t* output_bytes) {
+	*output_bytes = options->low_memory ? zw__low_memory_output : zw__output_bytes;
+	if (options->stream.write) {
+		*stream = options->stream;
+		if (options->non_blocking)
+			stream->submit = NULL;
+	} else {
+		if (!options->file_path)
+			return zw_false;
+#ifdef ZW__POSIX
+		if (!zw__open_fd_stream(stream, options))
+			return zw_false;
+#else
+		if (!zw__open_stdio(stream, options->file_path))
+			return zw_false;
+#endif
+	}
+
+	if (options->output_buffer_size)
+		*output_bytes = ZW_ROUND_UP(options->output_buffer_size < 1024 ? 1024 : options->output_buffer_size, 16);
+
+	return zw_true;
+}
+
+// Starts a new archive, in a fresh block or in the memory a finished one left behind.
+// Stretchy buffers are only emptied, and the window needs no clearing once the hash chains are.
+static void zw__zip_start(zw_zip archive, const zw_zip_options* options, zw_output_stream stream, size_t output_bytes) {
+	time_t rawtime;
+	struct tm local;
+
+#ifdef ZW__THREADS
+	{
+		// async_buffers falls back to a writer thread when the stream can't do asynchronous writes itself
+		int pipeline_buffers = options->pipeline_buffers ? options->pipeline_buffers : options->async_buffers;
+		if (pipeline_buffers > 0 && !stream.submit && !options->non_blocking)
+			zw__open_pipeline(&stream, pipeline_buffers, &archive->base);
+	}
+#endif // def ZW__THREADS
+
+	archive->deflate.bitbuf = 0;
+	archive->deflate.bitcount = 0;
+	archive->deflate.block_open = zw_false;
+	archive->deflate.block_final = zw_false;
+	archive->deflate.out = archive->own_out;
+	archive->deflate.out_cursor = 0;
+	archive->deflate.out_total = output_bytes < archive->out_capacity ? output_bytes : archive->out_capacity;
+	zw__reset_hash(&archive->deflate);
+
+	archive->stream = stream;
+	archive->offset = 0;
+	archive->non_blocking = options->non_blocking;
+	if (archive->pending)
+		zw__sbn(archive->pending) = 0;
+	archive->pending_cursor = 0;
+	archive->finishing = zw_false;
+	archive->current_file.name_length = 0;
+
+	if (archive->central_dir)
+		zw__sbn(archive->central_dir) = 0;
+	archive->num_files = 0;
+	archive->spill.limit = options->central_dir_memory;
+	archive->tiny_entry_size = options->tiny_entry_size < zw__max_tiny_entry ? options->tiny_entry_size : (size_t)zw__max_tiny_entry;
+
+	if (archive->cache.dir)
+		zw__sbn(archive->cache.dir) = 0;
+	if (options->cache_dir && *options->cache_dir) {
+		size_t dir_length = strlen(options->cache_dir);
+		zw__sbmaybegrow(&archive->allocator, archive->cache.dir, dir_length + 1);
+		ZW_MEMMOVE(archive->cache.dir, options->cache_dir, dir_length + 1);
+		zw__sbn(archive->cache.dir) = dir_length + 1;
+	}
+	archive->cache.teeing = zw_false;
+
+	// archives may be started on several threads at once
+	time(&rawtime);
+#if defined(_MSC_VER)
+	localtime_s(&local, &rawtime);
+#elif defined(ZW__POSIX)
+	localtime_r(&rawtime, &local);
+#else
+	local = *localtime(&rawtime);
+#endif
+	archive->date = zw__zip_encode_date(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+	archive->time = zw__zip_encode_time(local.tm_hour, local.tm_min, local.tm_sec);
+}
+
+// Context pool ///////////////////////////////////////////////
+
+#ifdef ZW__THREAD_LOCAL
+
+typedef struct {
+	zw_zip              contexts;
+	size_t              bytes;
+	size_t              max_bytes;
+} zw__pool;
+
+static ZW__THREAD_LOCAL zw__pool zw__thread_pool;
+
+static size_t zw__zip_retained_bytes(zw_zip archive) {
+	size_t bytes = archive->block_bytes;
+	zw__arena_block* block;
+	unsigned i;
+
+	if (archive->arena.block_size) {
+		for (block = archive->arena.blocks; block; block = block->next)
+			bytes += zw__arena_header_bytes + block->size;
+		return bytes;
+	}
+	for (i = 0; archive->deflate.hash_table && i < zw__hash_size; ++i)
+		if (archive->deflate.hash_table[i])
+			bytes += zw__sbm(archive->deflate.hash_table[i]) * sizeof(zw_u16) + sizeof(size_t)*2;
+	bytes += archive->central_dir ? zw__sbm(archive->central_dir) : 0;
+	bytes += archive->pending ? zw__sbm(archive->pending) : 0;
+	return bytes;
+}
+
+// Takes a pooled context that was made the way options would make one
+static zw_zip zw__pool_take(const zw_allocator* base, const zw_zip_options* options, size_t output_bytes) {
+	zw__pool* pool = &zw__thread_pool;
+	zw_zip* link;
+
+	for (link = &pool->contexts; *link; link = &(*link)->pool_next) {
+		zw_zip archive = *link;
+		if (archive->base.user_data == base->user_data && archive->base.allocate == base->allocate &&
+			archive->base.reallocate == base->reallocate && archive->base.deallocate == base->deallocate &&
+			archive->arena.block_size == options->arena_block_size && archive->low_memory == options->low_memory &&
+			archive->want_huge_pages == (options->huge_pages && !options->low_memory) && archive->out_capacity >= output_bytes)
+		{
+			*link = archive->pool_next;
+			pool->bytes -= archive->pool_bytes;
+			return archive;
+		}
+	}
+
+	return NULL;
+}
+
+static zw_bool zw__pool_put(zw_zip archive) {
+	zw__pool* pool = &zw__thread_pool;
+	size_t bytes;
+
+	if (!pool->max_bytes)
+		return zw_false;
+	bytes = zw__zip_retained_bytes(archive);
+	if (bytes > pool->max_bytes - pool->bytes)
+		return zw_false;
+
+	archive->pool_bytes = bytes;
+	archive->pool_next = pool->contexts;
+	pool->contexts = archive;
+	pool->bytes += bytes;
+	return zw_true;
+}
+
+void zw_pool_limit(size_t max_bytes) {
+	zw__pool* pool = &zw__thread_pool;
+
+	pool->max_bytes = max_bytes;
+	while (pool->contexts && pool->bytes > max_bytes) {
+		zw_zip archive = pool->contexts;
+		pool->contexts = archive->pool_next;
+		pool->bytes -= archive->pool_bytes;
+		zw__zip_free(archive);
+	}
+}
+
+#else
+
+static zw_zip zw__pool_take(const zw_allocator* base, const zw_zip_options* options, size_t output_bytes) {
+	(void)base;
+	(void)options;
+	(void)output_bytes;
+	return NULL;
+}
+
+static zw_bool zw__pool_put(zw_zip archive) {
+	(void)archive;
+	return zw_false;
+}
+
+void zw_pool_limit(size_t max_bytes) {
+	(void)max_bytes;
+}
+
+#endif // def ZW__THREAD_LOCAL
+
+zw_zip zw_create_ex(const zw_zip_options* options) {
+	const size_t archive_bytes  = ZW_ROUND_UP(sizeof(zw__zip_details), zw__cache_line_size);
+	size_t output_bytes;
+	size_t total_bytes;
+
+	zw_u8* mem_block;
+	zw_zip archive;
+
+	zw_output_stream stream;
+	zw_allocator base;
+	zw_bool want_huge_pages;
+
+	if (!options || !zw__open_output(&stream, options, &output_bytes))
+		return NULL;
+	total_bytes = archive_bytes + zw__deflate_bytes(options->low_memory) + output_bytes;
+
+	base = zw__options_allocator(&options->allocator);
+	archive = zw__pool_take(&base, options, output_bytes);
+	if (archive) {
+		archive->reusable = options->reusable;
+		zw__zip_start(archive, options, stream, output_bytes);
+		return archive;
+	}
+
+	// only the details and the hash table need to start out zeroed (zw__deflate_init sees to the latter)
+	want_huge_pages = options->huge_pages && !options->low_memory ? zw_true : zw_false;
+	archive = zw__zip_alloc(&base, total_bytes, want_huge_pages);
+	if (!archive) {
+		if (!options->stream.write)
+			stream.close(&stream);
+		return NULL;
+	}
+
+	mem_block = (zw_u8*)archive;
+	archive->magic = zw__archive_magic;
+	archive->base = base;
+	archive->reusable = options->reusable;
+	archive->low_memory = options->low_memory;
+	archive->want_huge_pages = want_huge_pages;
+	if (options->arena_block_size) {
+		archive->arena.base = base;
+		archive->arena.block_size = options->arena_block_size;
+		archive->allocator = zw__arena_allocator(&archive->arena);
+	} else {
+		archive->allocator = base;
+	}
+	mem_block += archive_bytes;
+
+	zw__deflate_init(&archive->deflate, mem_block, output_bytes, options->low_memory);
+	archive->deflate.out_full = &zw__zip_out_full;
+	archive->deflate.owner = archive;
+	archive->deflate.allocator = &archive->allocator;
+	archive->deflate.check = zw__check_crc32;
+	archive->own_out = archive->deflate.out;
+	archive->out_capacity = output_bytes;
+	archive->current_file.name = archive->current_file.name_buf;
+
+	zw__zip_start(archive, options, stream, output_bytes);
+
+	return archive;
+}
+
+zw_bool zw_reset(zw_zip archive, const zw_zip_options* options) {
+	zw_output_stream stream;
+	size_t output_bytes;
+
+	// only finished archives, whose stream is gone, can start over
+	if (!archive || !archive->reusable || archive->stream.write || !options)
+		return zw_false;
+	if (!zw__open_output(&stream, options, &output_bytes))
+		return zw_false;
+
+	zw__zip_start(archive, options, stream, output_bytes);
+
+	return zw_true;
+}
+
+void zw_release(zw_zip archive) {
+	if (archive && archive->reusable && !archive->stream.write && !zw__pool_put(archive))
+		zw__zip_free(archive);
+}
+
+// Once its local header is out, an entry can't be taken back: the archive fails with it
+static zw_bool zw__abandon_entry(zw_zip archive) {
+	archive->current_file.name_length = 0;
+	if (!archive->stream.error)
+		archive->stream.error = 1;
+	return zw_false;
+}
+
+static zw_bool zw__zip_end_file(zw_zip archive) {
+	zw__zip_data_descriptor data_desc;
+	zw__zip_central_dir_file_header central_header;
+	zw__zip_info64 info64;
+
+	if (!archive || !archive->current_file.name_length)
+		return zw_false;
+
+	if (archive->current_file.raw) {
+		// sizes were already written in the local header, so the data must match them
+		if (zw__tell(archive) - archive->current_file.data_offset != archive->current_file.compressed_size)
+			return zw__abandon_entry(archive);
+	} else {
+		zw__deflate_end(&archive->deflate);
+		archive->current_file.crc = archive->deflate.crc;
+		archive->current_file.uncompressed_size = archive->deflate.total_in;
+		archive->current_file.compressed_size = zw__tell(archive) - archive->current_file.data_offset;
+		if (archive->cache.teeing) {
+			zw__cache_tee(archive);
+			archive->cache.teeing = zw_false;
+		}
+
+		data_desc.crc                           = archive->current_file.crc;
+		data_desc.compressed_size               = ~(zw_u32)0;
+		data_desc.uncompressed_size             = ~(zw_u32)0;
+		if (!zw__write_output(archive, &data_desc, sizeof(data_desc)))
+			return zw_false;
+	}
+
+	central_header.signature                    = zw__zip_sig_central_dir_file_header;
+	central_header.spec_version                 = 45;
+	central_header.file_system                  = zw__zip_file_system_fat;
+	central_header.required_version             = 45;
+	central_header.flags                        = archive->current_file.flags;
+	central_header.compression_method           = archive->current_file.method;
+	central_header.file_time                    = archive->time;
+	central_header.file_date                    = archive->date;
+	central_header.crc                          = archive->current_file.crc;
+	central_header.compressed_size              = ~(zw_u32)0;
+	central_header.uncompressed_size            = ~(zw_u32)0;
+	central_header.file_name_length             = archive->current_file.name_length;
+	central_header.extra_field_length           = sizeof(zw__zip_info64);
+	central_header.file_comment_length          = 0;
+	central_header.start_disk                   = 0;
+	central_header.internal_attributes          = 0;
+	central_header.external_attributes          = 0;
+	central_header.local_header_relative_offset = ~(zw_u32)0;
+	if (!zw__append_to_central_dir(archive, &central_header, sizeof(central_header)))
+		return zw_false;
+	if (!zw__append_to_central_dir(archive, archive->current_file.name, central_header.file_name_length))
+		return zw_false;
+	
+	info64.header.id                            = zw__zip_info64_id;
+	info64.header.length                        = sizeof(info64) - sizeof(info64.header);
+	info64.compressed_size                      = archive->current_file.compressed_size;
+	info64.uncompressed_size                    = archive->current_file.uncompressed_size;
+	info64.local_header_relative_offset         = archive->current_file.start_offset;
+	if (!zw__append_to_central_dir(archive, &info64, sizeof(info64)))
+		return zw_false;
+
+	archive->current_file.name_length = 0;
+
+	return zw_true;
+}
+
+// Writes the local header and makes file_path the current entry.
+// Sizes and crc are only meaningful for raw entries (for compressed ones they go in the data descriptor).
+static zw_bool zw__zip_begin_entry(zw_zip archive, const char* file_path, zw_method method, zw_bool raw,
+                                   zw_u32 crc, zw_u64 compressed_size, zw_u64 uncompressed_size) {
+	zw__zip_local_file_header local_header;
+	zw__zip_local_info64 info64;
+	size_t name_length, name_capacity;
+	int need_info64;
+	zw_u64 offset;
+
+	if (!file_path || !*file_path)
+		return zw_false;
+
+	name_length = strlen(file_path);
+	if (name_length > 0xfffe)
+		name_length = 0xfffe;
+	offset = zw__tell(archive);
+	need_info64 = raw && (compressed_size >= 0xffffffffu || uncompressed_size >= 0xffffffffu);
+
+	local_header.signature              = zw__zip_sig_local_file_header;
 	local_header.version                = 45;
-	local_header.flags                  = zw__zip_flag_has_data_desc;
-	local_header.compression_method     = zw__zip_compression_method_deflate;
+	local_header.flags                  = raw ? 0 : zw__zip_flag_has_data_desc;
+	local_header.compression_method     = (zw_u16)method;
 	local_header.file_time              = archive->time;
 	local_header.file_date              = archive->date;
-	local_header.crc                    = 0;
-	local_header.compressed_size        = 0;
-	local_header.uncompressed_size      = 0;
+	local_header.crc                    = raw ? crc : 0;
+	local_header.compressed_size        = !raw ? 0 : need_info64 ? ~(zw_u32)0 : (zw_u32)compressed_size;
+	local_header.uncompressed_size      = !raw ? 0 : need_info64 ? ~(zw_u32)0 : (zw_u32)uncompressed_size;
 	local_header.file_name_length       = (zw_u16)name_length;
-	local_header.extra_field_length     = 0;
+	local_header.extra_field_length     = need_info64 ? sizeof(info64) : 0;
+
+	if (!zw__write_output(archive, &local_header, sizeof(local_header)))
+		return zw_false;
+	if (!zw__write_output(archive, file_path, name_length))
+		return zw_false;
+
+	if (need_info64) {
+		info64.header.id                = zw__zip_info64_id;
+		info64.header.length            = sizeof(info64) - sizeof(info64.header);
+		info64.uncompressed_size        = uncompressed_size;
+		info64.compressed_size          = compressed_size;
+		if (!zw__write_output(archive, &info64, sizeof(info64)))
+			return zw_false;
+	}
+
+	if (archive->current_file.name == archive->current_file.name_buf)
+		name_capacity = sizeof(archive->current_file.name_buf);
+	else
+		name_capacity = zw__sbm(archive->current_file.name);
+
+	if (name_length >= name_capacity) {
+		if (archive->current_file.name == archive->current_file.name_buf)
+			archive->current_file.name = NULL;
+		else
+			zw__sbn(archive->current_file.name) = 0;
+		name_capacity = name_length + 1;
+		if (name_capacity < 260)
+			name_capacity = 260;
+		zw__sbgrow(&archive->allocator, archive->current_file.name, name_capacity);
+	}
+	ZW_MEMMOVE(archive->current_file.name, file_path, name_length);
+	archive->current_file.name[name_length] = 0;
+
+	archive->current_file.name_length = (zw_u16)name_length;
+	archive->current_file.method = (zw_u16)method;
+	archive->current_file.flags = local_header.flags;
+	archive->current_file.raw = raw;
+	archive->current_file.compressed_size = raw ? compressed_size : 0;
+	archive->current_file.uncompressed_size = raw ? uncompressed_size : 0;
+	archive->current_file.crc = raw ? crc : 0;
+	archive->current_file.start_offset = offset;
+	archive->current_file.data_offset = zw__tell(archive);
+	archive->num_files++;
+
+	return zw_true;
+}
+
+static zw_bool zw__begin_file(zw_zip archive, const char* file_path) {
+	zw__zip_end_file(archive);
+
+	if (!zw__zip_begin_entry(archive, file_path, zw_method_deflate, zw_false, 0, 0, 0))
+		return zw_false;
+
+	if (archive->num_files > 1)
+		zw__reset_hash(&archive->deflate);
+
+	zw__deflate_begin(&archive->deflate);
+	if (archive->cache.file) {
+		archive->cache.teeing = zw_true;
+		archive->cache.mark = archive->deflate.out_cursor;
+	}
+
+	return zw_true;
+}
+
+zw_bool zw_begin_file(zw_zip archive, const char* file_path) {
+	if (!archive || !zw__ready(archive))
+		return zw_false;
+
+	return zw__begin_file(archive, file_path);
+}
+
+// Data written to raw entries is already compressed with the given method and goes straight to the output
+zw_bool zw_begin_file_raw(zw_zip archive, const char* file_path, zw_method method, unsigned crc,
+                          unsigned long long compressed_size, unsigned long long uncompressed_size) {
+	if (!archive || !zw__ready(archive))
+		return zw_false;
+	zw__zip_end_file(archive);
+
+	return zw__zip_begin_entry(archive, file_path, method, zw_true, crc, compressed_size, uncompressed_size);
+}
+
+static zw_bool zw__write(zw_zip archive, const void* data, size_t data_len) {
+	if (!archive->current_file.name_length)
+		return zw_false;
+
+	if (archive->current_file.raw) {
+		if (zw__tell(archive) - archive->current_file.data_offset + data_len > archive->current_file.compressed_size)
+			return zw_false;
+		return zw__write_output(archive, data, data_len);
+	}
+
+	zw__deflate_write(&archive->deflate, data, data_len);
+
+	return zw_true;
+}
+
+// Writes that fit in the input window without filling it take one bounds check and a copy
+static ZW_INLINE zw_bool zw__write_fast(zw_zip archive, const void* data, size_t data_len) {
+	zw__deflate_state* state;
+
+	if (!archive || !zw__ready(archive))
+		return zw_false;
+
+	state = &archive->deflate;
+	if (data_len < (size_t)(state->in_total - state->in_cursor) && archive->current_file.name_length && !archive->current_file.raw) {
+		ZW_MEMMOVE(state->window + 32768 + state->in_cursor, data, data_len);
+		state->in_cursor += (zw_u16)data_len;
+		return zw_true;
+	}
+
+	return zw__write(archive, data, data_len);
+}
+
+zw_bool zw_write(zw_zip archive, const void* data, size_t data_len) {
+	return zw__write_fast(archive, data, data_len);
+}
+
+zw_bool zw_write_text(zw_zip archive, const char* text) {
+	return zw__write_fast(archive, text, strlen(text));
+}
+
+zw_bool zw_putc(zw_zip archive, int c) {
+	zw_u8 byte = (zw_u8)c;
+	return zw__write_fast(archive, &byte, 1);
+}
+
+zw_bool zw_write_u32(zw_zip archive, unsigned value) {
+	zw_u8 bytes[4];
+	bytes[0] = (zw_u8)value;
+	bytes[1] = (zw_u8)(value >> 8);
+	bytes[2] = (zw_u8)(value >> 16);
+	bytes[3] = (zw_u8)(value >> 24);
+	return zw__write_fast(archive, bytes, sizeof(bytes));
+}
+
+zw_bool zw_write_u64(zw_zip archive, unsigned long long value) {
+	zw_u8 bytes[8];
+	int i;
+	for (i = 0; i < 8; ++i)
+		bytes[i] = (zw_u8)(value >> (i * 8));
+	return zw__write_fast(archive, bytes, sizeof(bytes));
+}
+
+// Formats straight into the free part of the input window. Text that doesn't fit what is left is formatted
+// again after flushing the batch; only text longer than a whole batch (or for raw entries) needs a buffer
+// (from the base allocator, as it is freed right away).
+zw_bool zw_vprintf(zw_zip archive, const char* format, va_list args) {
+	zw__deflate_state* state;
+	va_list retry;
+	char* text;
+	int length;
+	zw_bool result;
+
+	if (!archive || !format || !zw__ready(archive))
+		return zw_false;
+	if (!archive->current_file.name_length)
+		return zw_false;
+
+	state = &archive->deflate;
+	if (!archive->current_file.raw) {
+		size_t avail = state->in_total - state->in_cursor;
+		va_copy(retry, args);
+		length = vsnprintf((char*)state->window + 32768 + state->in_cursor, avail, format, retry);
+		va_end(retry);
+		if (length >= 0 && (size_t)length < avail) {
+			state->in_cursor += (zw_u16)length;
+			return zw_true;
+		}
+		if (length >= 0 && length < state->in_total) {
+			zw__flush_input(state, zw_false);
+			vsnprintf((char*)state->window + 32768, state->in_total, format, args);
+			state->in_cursor = (zw_u16)length;
+			return zw_true;
+		}
+	} else {
+		va_copy(retry, args);
+		length = vsnprintf(NULL, 0, format, retry);
+		va_end(retry);
+	}
+	if (length < 0)
+		return zw_false;
+
+	text = (char*)zw__alloc(&archive->base, (size_t)length + 1);
+	if (!text)
+		return zw_false;
+	vsnprintf(text, (size_t)length + 1, format, args);
+	result = zw__write(archive, text, (size_t)length);
+	zw__free(&archive->base, text, (size_t)length + 1);
+
+	return result;
+}
+
+zw_bool zw_printf(zw_zip archive, const char* format, ...) {
+	va_list args;
+	zw_bool result;
+
+	va_start(args, format);
+	result = zw_vprintf(archive, format, args);
+	va_end(args);
+
+	return result;
+}
+
+// Makes everything written so far decodable by whoever reads the stream, without ending the entry
+zw_bool zw_flush(zw_zip archive, zw_flush_mode mode) {
+	if (!archive || !zw__ready(archive))
+		return zw_false;
+
+	if (archive->current_file.name_length && !archive->current_file.raw) {
+		zw__deflate_sync(&archive->deflate, mode);
+	}
+
+	if (!zw__flush_output(archive))
+		return zw_false;
+	if (archive->stream.flush && zw__sbcount(archive->pending) == archive->pending_cursor)
+		archive->stream.flush(&archive->stream);
+
+	return archive->stream.error ? zw_false : zw_true;
+}
+
+// Compressed entry cache /////////////////////////////////////
+// Each cache file holds the deflate stream for one (content, quality, method) combination,
+// preceded by a zw__cache_header. Entries are recorded on a miss and replayed as raw entries on a hit.
+
+enum {
+	zw__cache_magic = ZW_FOURCC('z', 'w', 'C', '2'),
+};
+
+// Repeats the whole key from the file name, so a renamed or mismatched file is never taken for a hit
+typedef struct {
+	zw_u32              magic;
+	zw_u32              crc;
+	zw_u64              hash;
+	zw_u64              uncompressed_size;
+	zw_u64              compressed_size;
+	zw_u16              quality;
+	zw_u16              method;
+	zw_u32              reserved;
+} zw__cache_header;
+ZW_STATIC_ASSERT(sizeof(zw__cache_header) == 40);
+
+// Stretchy buffer from the base allocator: it only lives for one entry, so it stays out of the arena
+static char* zw__cache_path(zw_zip archive, const char* suffix) {
+	size_t capacity = strlen(archive->cache.dir) + strlen(suffix) + 80;
+	char* path = NULL;
+	zw__sbgrow(&archive->base, path, capacity);
+	if (path) {
+		snprintf(path, capacity, "%s/%016llx%08x-%llx-%u-%u%s.zwc", archive->cache.dir,
+			(unsigned long long)archive->cache.hash, (unsigned)archive->cache.crc,
+			(unsigned long long)archive->cache.size, (unsigned)archive->deflate.quality,
+			(unsigned)zw_method_deflate, suffix);
+	}
+	return path;
+}
+
+// Returns zw_false on a miss. Otherwise, *result tells whether the entry was written successfully.
+static zw_bool zw__cache_replay(zw_zip archive, const char* file_path, zw_bool* result) {
+	zw__cache_header header;
+	zw_u64 file_size;
+	zw_bool hit = zw_false;
+	char* path;
+	FILE* file;
+
+	path = zw__cache_path(archive, "");
+	if (!path)
+		return zw_false;
+	file = fopen(path, "rb");
+	zw__sbfree(&archive->base, path);
+	if (!file)
+		return zw_false;
+
+	if (zw__read_at(file, 0, &header, sizeof(header)) && zw__file_size(file, &file_size) &&
+		header.magic == zw__cache_magic && header.crc == archive->cache.crc && header.hash == archive->cache.hash &&
+		header.uncompressed_size == archive->cache.size &&
+		header.quality == archive->deflate.quality && header.method == zw_method_deflate &&
+		file_size >= sizeof(header) && header.compressed_size == file_size - sizeof(header))
+	{
+		hit = zw_true;
+		*result = zw__zip_begin_entry(archive, file_path, zw_method_deflate, zw_true,
+		                              header.crc, header.compressed_size, header.uncompressed_size);
+		if (*result) {
+			// the header is out, so there's no going back to compressing
+			*result = zw__copy_file_data(archive, file, sizeof(header), header.compressed_size) ?
+				zw__zip_end_file(archive) : zw__abandon_entry(archive);
+		}
+	}
+
+	fclose(file);
+	return hit;
+}
+
+static void zw__cache_record_begin(zw_zip archive) {
+	zw__cache_header header;
+	char suffix[64];
+
+	// unique per process and archive, so concurrent writers never share a temporary file
+#ifdef ZW__POSIX
+	snprintf(suffix, sizeof(suffix), ".%ld-%p.tmp", (long)getpid(), (void*)archive);
+#else
+	snprintf(suffix, sizeof(suffix), ".%p.tmp", (void*)archive);
+#endif
+	archive->cache.temp_path = zw__cache_path(archive, suffix);
+	if (!archive->cache.temp_path)
+		return;
+
+	archive->cache.file = fopen(archive->cache.temp_path, "wb");
+	if (archive->cache.file) {
+		memset(&header, 0, sizeof(header));
+		fwrite(&header, 1, sizeof(header), archive->cache.file);
+	} else {
+		zw__sbfree(&archive->base, archive->cache.temp_path);
+	}
+}
+
+static void zw__cache_record_end(zw_zip archive, zw_bool success) {
+	zw__cache_header header;
+	char* path;
+
+	if (!archive->cache.file)
+		return;
+
+	// the source may have changed between hashing and compressing
+	if (archive->current_file.crc != archive->cache.crc || archive->current_file.uncompressed_size != archive->cache.size)
+		success = zw_false;
+
+	if (success) {
+		header.magic                = zw__cache_magic;
+		header.crc                  = archive->current_file.crc;
+		header.hash                 = archive->cache.hash;
+		header.uncompressed_size    = archive->current_file.uncompressed_size;
+		header.compressed_size      = archive->current_file.compressed_size;
+		header.quality              = (zw_u16)archive->deflate.quality;
+		header.method               = zw_method_deflate;
+		header.reserved             = 0;
+		if (zw__fseek64(archive->cache.file, 0) != 0 || fwrite(&header, 1, sizeof(header), archive->cache.file) != sizeof(header))
+			success = zw_false;
+	}
+	if (ferror(archive->cache.file))
+		success = zw_false;
+	if (fclose(archive->cache.file) != 0)
+		success = zw_false;
+	archive->cache.file = NULL;
+
+	path = success ? zw__cache_path(archive, "") : NULL;
+	if (!path || rename(archive->cache.temp_path, path) != 0)
+		remove(archive->cache.temp_path);
+	zw__sbfree(&archive->base, path);
+	zw__sbfree(&archive->base, archive->cache.temp_path);
+}
+
+#define zw__is_tiny(archive, size) ((archive)->tiny_entry_size && (size) <= (archive)->tiny_entry_size)
+
+// Written as a raw entry, deflated or stored, whichever is smaller. The deflated data is put together in
+// the window's history, which the next deflated entry doesn't look at: it resets the hash chains.
+static zw_bool zw__add_tiny(zw_zip archive, const char* file_path, const void* data, size_t data_len) {
+	zw_u32 crc = zw__crc32((const zw_u8*)data, data_len, 0);
+	size_t packed_len = zw__deflate_tiny(archive->deflate.window, (const zw_u8*)data, (zw_u16)data_len);
+	zw_bool packed = packed_len < data_len ? zw_true : zw_false;
+
+	if (!zw__zip_begin_entry(archive, file_path, packed ? zw_method_deflate : zw_method_store, zw_true,
+	                         crc, packed ? packed_len : data_len, data_len))
+		return zw_false;
+	if (!zw__write_output(archive, packed ? archive->deflate.window : data, packed ? packed_len : data_len))
+		return zw__abandon_entry(archive);
+
+	return zw__zip_end_file(archive);
+}
+
+static zw_bool zw__add_data(zw_zip archive, const char* file_path, const void* data, size_t data_len) {
+	zw_bool result;
+
+	if (!data && data_len)
+		return zw_false;
+	zw__zip_end_file(archive);
+	if (zw__is_tiny(archive, data_len))
+		return zw__add_tiny(archive, file_path, data, data_len);
+
+	if (zw__sbcount(archive->cache.dir)) {
+		archive->cache.crc  = zw__crc32((const zw_u8*)data, data_len, 0);
+		archive->cache.hash = zw__hash64_final(zw__hash64((const zw_u8*)data, data_len, 0), data_len);
+		archive->cache.size = data_len;
+		if (zw__cache_replay(archive, file_path, &result))
+			return result;
+		zw__cache_record_begin(archive);
+	}
+
+	result = zw__begin_file(archive, file_path) && zw__write(archive, data, data_len) ? zw_true : zw_false;
+	if (!zw__zip_end_file(archive))
+		result = zw_false;
+	zw__cache_record_end(archive, result);
+
+	return result;
+}
+
+zw_bool zw_add_data(zw_zip archive, const char* file_path, const void* data, size_t data_len) {
+	if (!archive || !zw__ready(archive))
+		return zw_false;
+
+	return zw__add_data(archive, file_path, data, data_len);
+}
+
+// Checked once for the whole batch, so a non-blocking stream's backlog may grow while it runs.
+// Stops at the first entry that fails; the ones before it are in the archive.
+zw_bool zw_add_entries(zw_zip archive, const zw_entry* entries, size_t count) {
+	zw_bool cached;
+	size_t i;
 
-	if (!zw__write_to_stream(archive, &local_header, sizeof(local_header)))
+	if (!archive || (!entries && count) || !zw__ready(archive))
 		return zw_false;
-	if (!zw__write_to_stream(archive, file_path, name_length))
+
+	cached = zw__sbcount(archive->cache.dir) ? zw_true : zw_false;
+	for (i = 0; i < count; ++i) {
+		if (cached || zw__is_tiny(archive, entries[i].size)) {
+			if (!zw__add_data(archive, entries[i].file_path, entries[i].data, entries[i].size))
+				return zw_false;
+			continue;
+		}
+		if (!entries[i].data && entries[i].size)
+			return zw_false;
+		if (!zw__begin_file(archive, entries[i].file_path))
+			return zw_false;
+		zw__deflate_write(&archive->deflate, entries[i].data, entries[i].size);
+		if (!zw__zip_end_file(archive))
+			return zw_false;
+	}
+
+	return zw_true;
+}
+
+static zw_bool zw__add_stored_file(zw_zip archive, const char* file_path, FILE* file) {
+	zw_u64 size;
+	zw_u32 crc;
+
+	// the crc has to be known before the header goes out, which leaves the data free to be copied verbatim
+	if (!zw__file_size(file, &size) || !zw__scan_file(archive, file, size, &crc, NULL))
+		return zw_false;
+	if (!zw__zip_begin_entry(archive, file_path, zw_method_store, zw_true, crc, size, size))
 		return zw_false;
+	if (!zw__copy_file_data(archive, file, 0, size))
+		return zw__abandon_entry(archive);
 
-	if (archive->current_file.name == archive->current_file.name_buf)
-		name_capacity = sizeof(archive->current_file.name_buf);
-	else
-		name_capacity = zw__sbm(archive->current_file.name);
+	return zw__zip_end_file(archive);
+}
 
-	if (name_length >= name_capacity) {
-		if (archive->current_file.name == archive->current_file.name_buf)
-			archive->current_file.name = NULL;
-		else
-			zw__sbn(archive->current_file.name) = 0;
-		name_capacity = name_length + 1;
-		if (name_capacity < 260)
-			name_capacity = 260;
-		zw__sbgrow(archive->current_file.name, name_capacity);
+static zw_bool zw__add_deflated_file(zw_zip archive, const char* file_path, FILE* file) {
+	zw_bool result = zw_true;
+	zw_u64 size;
+
+	if (zw__sbcount(archive->cache.dir) && zw__file_size(file, &size) &&
+		zw__scan_file(archive, file, size, &archive->cache.crc, &archive->cache.hash))
+	{
+		archive->cache.hash = zw__hash64_final(archive->cache.hash, size);
+		archive->cache.size = size;
+		if (zw__cache_replay(archive, file_path, &result))
+			return result;
+		if (zw__fseek64(file, 0) != 0)
+			return zw_false;
+		zw__cache_record_begin(archive);
 	}
-	ZW_MEMMOVE(archive->current_file.name, file_path, name_length);
-	archive->current_file.name[name_length] = 0;
 
-	if (archive->num_files) {
-		// reset lengths of hash table chains
-		for (i = 0; i < zw__hash_size; ++i) {
-			zw_u16 *hlist = archive->hash_table[i];
-			if (hlist)
-				zw__sbn(hlist) = 0;
+	if (!zw__begin_file(archive, file_path)) {
+		zw__cache_record_end(archive, zw_false);
+		return zw_false;
+	}
+
+	// read straight into the input window
+	for (;;) {
+		size_t avail = archive->deflate.in_total - archive->deflate.in_cursor;
+		size_t read = fread(archive->deflate.window + 32768 + archive->deflate.in_cursor, 1, avail, file);
+		archive->deflate.in_cursor += (zw_u16)read;
+		if (archive->deflate.in_cursor == archive->deflate.in_total)
+			zw__flush_input(&archive->deflate, zw_false);
+		if (read < avail)
+			break;
+	}
+	if (ferror(file))
+		result = zw_false;
+
+	if (!zw__zip_end_file(archive))
+		result = zw_false;
+	zw__cache_record_end(archive, result);
+
+	return result;
+}
+
+// The source reads straight into the input window. If it fails, the entry is still ended with what it gave.
+zw_bool zw_add_stream(zw_zip archive, const char* file_path, zw_read_func read, void* user_data) {
+	zw__deflate_state* state;
+	zw_bool result = zw_true;
+
+	if (!archive || !read || !zw__ready(archive))
+		return zw_false;
+	if (!zw__begin_file(archive, file_path))
+		return zw_false;
+
+	state = &archive->deflate;
+	for (;;) {
+		size_t avail = state->in_total - state->in_cursor;
+		size_t got = read(user_data, state->window + 32768 + state->in_cursor, avail);
+		if (got == 0)
+			break;
+		if (got > avail) {
+			result = zw_false;
+			break;
 		}
+		state->in_cursor += (zw_u16)got;
+		if (state->in_cursor == state->in_total)
+			zw__flush_input(state, zw_false);
 	}
 
-	archive->in_cursor = 0;
-	archive->out_cursor = 0;
-	archive->current_file.name_length = (zw_u16)name_length;
-	archive->current_file.compressed_size = 0;
-	archive->current_file.uncompressed_size = 0;
-	archive->current_file.crc = 0;
-	archive->current_file.start_offset = offset;
-	archive->num_files++;
+	if (!zw__zip_end_file(archive))
+		result = zw_false;
 
-	// begin raw deflate block
-	zw__zlib_add(1,1);  // BFINAL = 1
-	zw__zlib_add(1,2);  // BTYPE  = 01 (fixed Huffman)
+	return result;
+}
 
-	return zw_true;
+zw_bool zw_add_file(zw_zip archive, const char* file_path, const char* source_path, zw_method method) {
+	FILE* file;
+	zw_bool result;
+
+	if (!archive || !source_path || !zw__ready(archive))
+		return zw_false;
+	if (method != zw_method_store && method != zw_method_deflate)
+		return zw_false;
+	zw__zip_end_file(archive);
+
+	file = fopen(source_path, "rb");
+	if (!file)
+		return zw_false;
+
+	if (method == zw_method_store)
+		result = zw__add_stored_file(archive, file_path, file);
+	else
+		result = zw__add_deflated_file(archive, file_path, file);
+
+	fclose(file);
+
+	return result;
 }
 
-zw_bool zw_write(zw_zip archive, const void* data, size_t data_len) {
-	if (!archive || !archive->num_files)
+// Compacts extra fields in place, leaving out the ZIP64 one (written anew) and, for a renamed entry,
+// the ones tied to the old name. A field running past the end stops the scan.
+static size_t zw__keep_extra_fields(zw_u8* extra, size_t size, zw_bool renamed) {
+	zw__zip_extra_header field;
+	size_t pos = 0, kept = 0, field_size;
+
+	while (size - pos >= sizeof(field)) {
+		memcpy(&field, extra + pos, sizeof(field));
+		field_size = sizeof(field) + field.length;
+		if (field_size > size - pos)
+			break;
+		if (field.id != zw__zip_info64_id && !(renamed && field.id == zw__zip_unicode_path_id)) {
+			ZW_MEMMOVE(extra + kept, extra + pos, field_size);
+			kept += field_size;
+		}
+		pos += field_size;
+	}
+
+	return kept;
+}
+
+// The source's central directory record is carried over (version, flags, time, attributes, extra fields,
+// comment); only the name, if renamed, the local header offset and the ZIP64 fields are rewritten.
+// The new local header has the sizes, so the data is followed by no data descriptor.
+zw_bool zw_copy_entry(zw_zip archive, zw_source source, size_t index, const char* file_path) {
+	zw__zip_local_file_header local_header;
+	zw__zip_central_dir_file_header central_header;
+	zw__zip_local_info64 local_info64;
+	zw__zip_info64 info64;
+	const zw__source_entry* entry;
+	const zw_u8* record;
+	const zw_u8* comment;
+	const char* source_name;
+	zw_u8* extra = NULL;
+	size_t name_length, extra_bytes = 0, local_extra = 0, central_extra = 0;
+	zw_u64 data_offset, start_offset;
+	zw_bool renamed, need_info64, ok;
+
+	if (!archive || index >= zw_source_count(source) || !zw__ready(archive))
 		return zw_false;
+	zw__zip_end_file(archive);
 
-	while (data_len > 0) {
-		zw_u16 avail = archive->in_total - archive->in_cursor;
-		zw_u16 batch = data_len < avail ? (zw_u16)data_len : avail;
-		ZW_MEMMOVE(archive->window + 32768 + archive->in_cursor, data, batch);
-		archive->in_cursor += batch;
-		if (archive->in_cursor == archive->in_total)
-			zw__flush_input(archive);
-		data_len -= batch;
-		data = (const zw_u8*)data + batch;
+	entry = &source->entries[index];
+	if (entry->flags & zw__zip_flag_encrypted)
+		return zw_false;
+
+	source_name = source->names + entry->name;
+	renamed = file_path && strcmp(file_path, source_name) != 0 ? zw_true : zw_false;
+	if (!file_path)
+		file_path = source_name;
+	if (!*file_path)
+		return zw_false;
+	name_length = strlen(file_path);
+	if (name_length > 0xfffe)
+		name_length = 0xfffe;
+
+	record = source->central_dir + entry->record;
+	memcpy(&central_header, record, sizeof(central_header));
+	comment = record + sizeof(central_header) + central_header.file_name_length + central_header.extra_field_length;
+
+	// the data starts after the *local* name and extra field, which may differ from the central ones
+	if (!zw__read_at(source->file, entry->local_header_offset, &local_header, sizeof(local_header)) ||
+		local_header.signature != zw__zip_sig_local_file_header)
+		return zw_false;
+	data_offset = entry->local_header_offset + sizeof(local_header) + local_header.file_name_length + local_header.extra_field_length;
+
+	// both sets of extra fields, filtered in one scratch block
+	extra_bytes = (size_t)local_header.extra_field_length + central_header.extra_field_length;
+	if (extra_bytes) {
+		extra = (zw_u8*)zw__alloc(&archive->base, extra_bytes);
+		if (!extra)
+			return zw_false;
+		ok = zw__read_at(source->file, data_offset - local_header.extra_field_length, extra, local_header.extra_field_length);
+		if (ok) {
+			local_extra = zw__keep_extra_fields(extra, local_header.extra_field_length, renamed);
+			ZW_MEMMOVE(extra + local_extra, record + sizeof(central_header) + central_header.file_name_length, central_header.extra_field_length);
+			central_extra = zw__keep_extra_fields(extra + local_extra, central_header.extra_field_length, renamed);
+		}
+	} else {
+		ok = zw_true;
 	}
 
-	return zw_true;
+	need_info64 = entry->compressed_size >= 0xffffffffu || entry->uncompressed_size >= 0xffffffffu ? zw_true : zw_false;
+	if (local_extra + (need_info64 ? sizeof(local_info64) : 0) > 0xffff || central_extra + sizeof(info64) > 0xffff)
+		ok = zw_false;
+	start_offset = zw__tell(archive);
+
+	local_header.version                = central_header.required_version > 45 ? central_header.required_version : 45;
+	local_header.flags                  = central_header.flags & ~zw__zip_flag_has_data_desc;
+	local_header.compression_method     = central_header.compression_method;
+	local_header.file_time              = central_header.file_time;
+	local_header.file_date              = central_header.file_date;
+	local_header.crc                    = entry->crc;
+	local_header.compressed_size        = need_info64 ? ~(zw_u32)0 : (zw_u32)entry->compressed_size;
+	local_header.uncompressed_size      = need_info64 ? ~(zw_u32)0 : (zw_u32)entry->uncompressed_size;
+	local_header.file_name_length       = (zw_u16)name_length;
+	local_header.extra_field_length     = (zw_u16)(local_extra + (need_info64 ? sizeof(local_info64) : 0));
+
+	local_info64.header.id              = zw__zip_info64_id;
+	local_info64.header.length          = sizeof(local_info64) - sizeof(local_info64.header);
+	local_info64.uncompressed_size      = entry->uncompressed_size;
+	local_info64.compressed_size        = entry->compressed_size;
+
+	if (ok && !(
+		zw__write_output(archive, &local_header, sizeof(local_header)) &&
+		zw__write_output(archive, file_path, name_length) &&
+		zw__write_output(archive, extra, local_extra) &&
+		(!need_info64 || zw__write_output(archive, &local_info64, sizeof(local_info64))) &&
+		zw__copy_file_data(archive, source->file, data_offset, entry->compressed_size)))
+		ok = zw__abandon_entry(archive);
+
+	central_header.required_version             = local_header.version;
+	central_header.flags                        = local_header.flags;
+	central_header.crc                          = entry->crc;
+	central_header.compressed_size              = ~(zw_u32)0;
+	central_header.uncompressed_size            = ~(zw_u32)0;
+	central_header.file_name_length             = (zw_u16)name_length;
+	central_header.extra_field_length           = (zw_u16)(central_extra + sizeof(info64));
+	central_header.start_disk                   = 0;
+	central_header.local_header_relative_offset = ~(zw_u32)0;
+
+	info64.header.id                            = zw__zip_info64_id;
+	info64.header.length                        = sizeof(info64) - sizeof(info64.header);
+	info64.compressed_size                      = entry->compressed_size;
+	info64.uncompressed_size                    = entry->uncompressed_size;
+	info64.local_header_relative_offset         = start_offset;
+
+	ok = ok &&
+		zw__append_to_central_dir(archive, &central_header, sizeof(central_header)) &&
+		zw__append_to_central_dir(archive, file_path, name_length) &&
+		zw__append_to_central_dir(archive, extra ? extra + local_extra : NULL, central_extra) &&
+		zw__append_to_central_dir(archive, &info64, sizeof(info64)) &&
+		zw__append_to_central_dir(archive, comment, central_header.file_comment_length) ? zw_true : zw_false;
+
+	if (extra)
+		zw__free(&archive->base, extra, extra_bytes);
+	if (ok)
+		archive->num_files++;
+
+	return ok;
 }
 
-zw_bool zw_write_text(zw_zip archive, const char* text) {
-	return zw_write(archive, text, strlen(text));
+// Spilled records are read back in chunks through the in-memory buffer
+static zw_bool zw__write_central_dir(zw_zip archive) {
+	zw_u64 left;
+	size_t chunk;
+
+	if (!archive->spill.file)
+		return zw__write_output(archive, archive->central_dir, zw__sbcount(archive->central_dir));
+
+	if (!zw__spill_central_dir(archive) || zw__fseek64(archive->spill.file, 0) != 0)
+		return zw_false;
+	chunk = zw__sbm(archive->central_dir);
+	for (left = archive->spill.size; left > 0; left -= chunk) {
+		if (chunk > left)
+			chunk = (size_t)left;
+		if (fread(archive->central_dir, 1, chunk, archive->spill.file) != chunk)
+			return zw_false;
+		if (!zw__write_output(archive, archive->central_dir, chunk))
+			return zw_false;
+	}
+
+	return zw_true;
 }
 
 zw_bool zw_finish(zw_zip archive) {
@@ -944,23 +4136,20 @@ zw_bool zw_finish(zw_zip archive) {
 
 	zw_bool result = zw_true;
 	zw_u64 offset;
-	size_t central_dir_size;
-	unsigned i;
+	zw_u64 central_dir_size;
 
 	if (!archive)
 		return zw_false;
+	if (archive->finishing)
+		goto drain;
+	archive->finishing = zw_true;
 	zw__zip_end_file(archive);
 
-	for (i=0; i<zw__hash_size; ++i)
-		zw__sbfree(archive->hash_table[i]);
-	if (archive->current_file.name != archive->current_file.name_buf)
-		zw__sbfree(archive->current_file.name);
-
-	offset = archive->offset;
-	central_dir_size = zw__sbcount(archive->central_dir);
-	if (result && !zw__write_to_stream(archive, archive->central_dir, central_dir_size))
+	offset = zw__tell(archive);
+	central_dir_size = archive->spill.size + zw__sbcount(archive->central_dir);
+	if (result && !zw__write_central_dir(archive))
 		result = zw_false;
-	zw__sbfree(archive->central_dir);
+	zw__close_spill(archive);
 
 	eocd64.signature                        = zw__zip_sig_eocd64;
 	eocd64.end_of_central_dir_64_size       = sizeof(eocd64) - 12;	// https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT, 4.3.14.1
@@ -973,20 +4162,30 @@ zw_bool zw_finish(zw_zip archive) {
 	eocd64.central_dir_size                 = central_dir_size;
 	eocd64.central_dir_offset               = offset;
 	offset += central_dir_size;
-	if (result && !zw__write_to_stream(archive, &eocd64, sizeof(eocd64)))
+	if (result && !zw__write_output(archive, &eocd64, sizeof(eocd64)))
 		result = zw_false;
 	
 	eocdloc64.signature                     = zw__zip_sig_eocdloc64;
 	eocdloc64.end_of_central_dir_64_disk	= 0;
 	eocdloc64.end_of_central_dir_64_offset  = offset;
 	eocdloc64.num_total_disks               = 1;
-	if (!zw__write_to_stream(archive, &eocdloc64, sizeof(eocdloc64)))
+	if (!zw__write_output(archive, &eocdloc64, sizeof(eocdloc64)))
 		result = zw_false;
 	
 	memset(&eocd, 0xff, sizeof(eocd));
 	eocd.signature                          = zw__zip_sig_eocd;
 	eocd.comment_length                     = 0;
-	if (result && !zw__write_to_stream(archive, &eocd, sizeof(eocd)))
+	if (result && !zw__write_output(archive, &eocd, sizeof(eocd)))
+		result = zw_false;
+	if (!zw__flush_output(archive))
+		result = zw_false;
+	// a call resumed below wouldn't know about this failure otherwise
+	if (!result && !archive->stream.error)
+		archive->stream.error = 1;
+
+drain:
+	// the archive stays around until a non-blocking stream has taken everything
+	if (archive->non_blocking && !zw__drain_pending(archive) && !archive->stream.error)
 		return zw_false;
 
 	if (archive->stream.close)
@@ -994,7 +4193,446 @@ zw_bool zw_finish(zw_zip archive) {
 	if (archive->stream.error)
 		result = zw_false;
 
-	ZW_FREE(archive);
+	memset(&archive->stream, 0, sizeof(archive->stream));
+	if (!archive->reusable && !zw__pool_put(archive))
+		zw__zip_free(archive);
+
+	return result;
+}
+
+zw_bool zw_would_block(zw_zip archive) {
+	if (!archive || !archive->non_blocking || archive->stream.error)
+		return zw_false;
+
+	return archive->pending_cursor < zw__sbcount(archive->pending) ? zw_true : zw_false;
+}
+
+// Standalone deflate streams //////////////////////////////////
+
+typedef struct zw__deflate_details {
+	zw__deflate_state   state;
+	zw_output_stream    stream;
+	zw_deflate_format   format;
+} zw__deflate_details;
+
+static void zw__deflate_out_full(void* owner) {
+	zw_deflate deflate = (zw_deflate)owner;
+	size_t size = deflate->state.out_cursor;
+
+	deflate->state.out_cursor = 0;
+	if (!size || deflate->stream.error)
+		return;
+	if (deflate->stream.write(&deflate->stream, deflate->state.out, size) != size && !deflate->stream.error)
+		deflate->stream.error = 1;
+}
+
+// Header and trailer bytes, only written on byte boundaries
+static void zw__deflate_put(zw__deflate_state* state, const zw_u8* bytes, size_t count) {
+	size_t i;
+
+	ZW_ASSERT(state->bitcount == 0);
+	for (i = 0; i < count; ++i) {
+		state->out[state->out_cursor++] = bytes[i];
+		if (state->out_cursor == state->out_total)
+			state->out_full(state->owner);
+	}
+}
+
+static void zw__deflate_put_gzip_header(zw__deflate_state* state) {
+	static const zw_u8 gzip_header[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255 };  // no name or time, unknown OS
+	zw__deflate_put(state, gzip_header, sizeof(gzip_header));
+}
+
+static void zw__deflate_put_gzip_trailer(zw__deflate_state* state) {
+	zw_u32 crc = state->crc, size = (zw_u32)state->total_in;
+	zw_u8 trailer[8];
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		trailer[i] = (zw_u8)(crc >> (i * 8));
+		trailer[i + 4] = (zw_u8)(size >> (i * 8));
+	}
+	zw__deflate_put(state, trailer, sizeof(trailer));
+}
+
+zw_deflate zw_deflate_create(zw_deflate_format format, const zw_output_stream* stream) {
+	static const zw_u8 zlib_header[] = { 0x78, 0x01 };  // deflate with a 32K window, fastest compression
+
+	const size_t details_bytes  = ZW_ROUND_UP(sizeof(zw__deflate_details), 16);
+	const size_t deflate_bytes  = zw__deflate_bytes(zw_false);
+	const size_t output_bytes   = 32768;
+
+	zw_u8* mem_block;
+	zw_deflate deflate;
+
+	if (!stream || !stream->write)
+		return NULL;
+	if (format != zw_deflate_raw && format != zw_deflate_zlib && format != zw_deflate_gzip)
+		return NULL;
+
+	mem_block = (zw_u8*) ZW_MALLOC(details_bytes + deflate_bytes + output_bytes);
+	if (!mem_block)
+		return NULL;
+	memset(mem_block, 0, details_bytes);
+
+	deflate = (zw_deflate)mem_block;
+	deflate->stream = *stream;
+	deflate->format = format;
+	mem_block += details_bytes;
+
+	zw__deflate_init(&deflate->state, mem_block, output_bytes, zw_false);
+	deflate->state.out_full = &zw__deflate_out_full;
+	deflate->state.owner = deflate;
+	deflate->state.check = format == zw_deflate_zlib ? zw__check_adler32 : format == zw_deflate_gzip ? zw__check_crc32 : 0;
+	zw__deflate_begin(&deflate->state);
+
+	if (format == zw_deflate_zlib)
+		zw__deflate_put(&deflate->state, zlib_header, sizeof(zlib_header));
+	else if (format == zw_deflate_gzip)
+		zw__deflate_put_gzip_header(&deflate->state);
+
+	return deflate;
+}
+
+zw_bool zw_deflate_write(zw_deflate deflate, const void* data, size_t data_len) {
+	if (!deflate || (!data && data_len) || deflate->stream.error)
+		return zw_false;
+
+	zw__deflate_write(&deflate->state, data, data_len);
+
+	return deflate->stream.error ? zw_false : zw_true;
+}
+
+zw_bool zw_deflate_flush(zw_deflate deflate, zw_flush_mode mode) {
+	if (!deflate || deflate->stream.error)
+		return zw_false;
+
+	zw__deflate_sync(&deflate->state, mode);
+	zw__deflate_out_full(deflate);
+	if (deflate->stream.flush && !deflate->stream.error)
+		deflate->stream.flush(&deflate->stream);
+
+	return deflate->stream.error ? zw_false : zw_true;
+}
+
+zw_bool zw_deflate_finish(zw_deflate deflate) {
+	zw_u8 trailer[4];
+	zw_bool result;
+
+	if (!deflate)
+		return zw_false;
+
+	zw__deflate_end(&deflate->state);
+	if (deflate->format == zw_deflate_zlib) {
+		zw_u32 adler = deflate->state.adler;
+		trailer[0] = (zw_u8)(adler >> 24);
+		trailer[1] = (zw_u8)(adler >> 16);
+		trailer[2] = (zw_u8)(adler >> 8);
+		trailer[3] = (zw_u8)adler;
+		zw__deflate_put(&deflate->state, trailer, 4);
+	} else if (deflate->format == zw_deflate_gzip) {
+		zw__deflate_put_gzip_trailer(&deflate->state);
+	}
+	zw__deflate_out_full(deflate);
+
+	zw__free_chains(&deflate->state);
+
+	if (deflate->stream.close)
+		deflate->stream.close(&deflate->stream);
+	result = deflate->stream.error ? zw_false : zw_true;
+
+	ZW_FREE(deflate);
+
+	return result;
+}
+
+// Parallel gzip ///////////////////////////////////////////////
+// The calling thread cuts the input into jobs and writes finished members out in order; workers
+// take filled jobs in order and compress each into a complete gzip member. Without threads, the
+// calling thread compresses each job itself as soon as it is filled.
+
+typedef struct {
+	zw_u8*              input;
+	size_t              input_size;
+	zw_u8*              output;         // stretchy buffer, one complete gzip member
+	unsigned            done;
+} zw__gzip_job;
+
+typedef struct {
+	zw__deflate_state   state;
+	zw__gzip_job*       job;
+	struct zw__gzip_details* gzip;
+#ifdef ZW__THREADS
+	zw__thread          thread;
+#endif
+} zw__gzip_worker;
+
+typedef struct zw__gzip_details {
+	zw_output_stream    stream;
+	size_t              member_size;
+
+	zw__gzip_job*       jobs;
+	unsigned            num_jobs;
+	unsigned            filled;         // jobs handed to the workers so far
+	unsigned            taken;          // jobs picked up by a worker so far
+	unsigned            written;        // jobs written to the stream so far
+
+	zw__gzip_worker*    workers;
+	unsigned            num_workers;
+	unsigned            num_threads;    // 0 when the calling thread does the compression
+	zw_bool             done;
+#ifdef ZW__THREADS
+	zw__mutex           mutex;
+	zw__cond            cond;
+#endif
+} zw__gzip_details;
+
+static void zw__gzip_out_full(void* owner) {
+	zw__gzip_worker* worker = (zw__gzip_worker*)owner;
+	zw__gzip_job* job = worker->job;
+	size_t size = worker->state.out_cursor;
+
+	zw__sbmaybegrow(&zw__default_allocator, job->output, size);
+	ZW_MEMMOVE(job->output + zw__sbn(job->output), worker->state.out, size);
+	zw__sbn(job->output) += size;
+	worker->state.out_cursor = 0;
+}
+
+static void zw__gzip_compress(zw__gzip_worker* worker, zw__gzip_job* job) {
+	zw__deflate_state* state = &worker->state;
+
+	worker->job = job;
+	zw__reset_hash(state);
+	zw__deflate_begin(state);
+	zw__deflate_put_gzip_header(state);
+	zw__deflate_write(state, job->input, job->input_size);
+	zw__deflate_end(state);
+	zw__deflate_put_gzip_trailer(state);
+	zw__gzip_out_full(worker);
+}
+
+#ifdef ZW__THREADS
+ZW__THREAD_PROC(zw__gzip_run) {
+	zw__gzip_worker* worker = (zw__gzip_worker*)arg;
+	zw_gzip gzip = worker->gzip;
+	zw__gzip_job* job;
+
+	for (;;) {
+		zw__mutex_lock(&gzip->mutex);
+		while (gzip->taken == gzip->filled && !gzip->done)
+			zw__cond_wait(&gzip->cond, &gzip->mutex);
+		if (gzip->taken == gzip->filled) {
+			zw__mutex_unlock(&gzip->mutex);
+			break;
+		}
+		job = &gzip->jobs[gzip->taken++ % gzip->num_jobs];
+		zw__mutex_unlock(&gzip->mutex);
+
+		zw__gzip_compress(worker, job);
+
+		zw__mutex_lock(&gzip->mutex);
+		job->done = 1;
+		zw__cond_broadcast(&gzip->cond);
+		zw__mutex_unlock(&gzip->mutex);
+	}
+
+	ZW__THREAD_RETURN;
+}
+#endif // def ZW__THREADS
+
+// Writes out the oldest job once it is compressed; returns false without waiting if it isn't and wait is false
+static zw_bool zw__gzip_write_oldest(zw_gzip gzip, zw_bool wait) {
+	zw__gzip_job* job = &gzip->jobs[gzip->written % gzip->num_jobs];
+	unsigned done;
+	size_t size;
+
+	if (gzip->written == gzip->filled)
+		return zw_false;
+#ifdef ZW__THREADS
+	if (gzip->num_threads) {
+		zw__mutex_lock(&gzip->mutex);
+		while (!job->done && wait)
+			zw__cond_wait(&gzip->cond, &gzip->mutex);
+		done = job->done;
+		zw__mutex_unlock(&gzip->mutex);
+	} else
+#else
+	(void)wait; // without threads, jobs are compressed as they are submitted
+#endif
+	done = job->done;
+	if (!done)
+		return zw_false;
+
+	size = zw__sbcount(job->output);
+	if (size && !gzip->stream.error &&
+		gzip->stream.write(&gzip->stream, job->output, size) != size && !gzip->stream.error)
+		gzip->stream.error = 1;
+	if (job->output)
+		zw__sbn(job->output) = 0;
+	job->input_size = 0;
+	job->done = 0;
+	gzip->written++;
+
+	return zw_true;
+}
+
+// Hands the job being filled to the workers
+static void zw__gzip_submit(zw_gzip gzip) {
+	zw__gzip_job* job = &gzip->jobs[gzip->filled % gzip->num_jobs];
+
+	if (!gzip->num_threads) {
+		zw__gzip_compress(&gzip->workers[0], job);
+		job->done = 1;
+		gzip->filled++;
+	}
+#ifdef ZW__THREADS
+	else {
+		zw__mutex_lock(&gzip->mutex);
+		gzip->filled++;
+		zw__cond_broadcast(&gzip->cond);
+		zw__mutex_unlock(&gzip->mutex);
+	}
+#endif
+
+	// keep the output flowing, and make room for the next job
+	while (zw__gzip_write_oldest(gzip, zw_false))
+		;
+	if (gzip->filled - gzip->written == gzip->num_jobs)
+		zw__gzip_write_oldest(gzip, zw_true);
+}
+
+zw_gzip zw_gzip_create(const zw_gzip_options* options) {
+	const size_t details_bytes  = ZW_ROUND_UP(sizeof(zw__gzip_details), 16);
+	const size_t worker_bytes   = ZW_ROUND_UP(sizeof(zw__gzip_worker), 16);
+	const size_t job_bytes      = ZW_ROUND_UP(sizeof(zw__gzip_job), 16);
+	const size_t state_bytes    = zw__deflate_bytes(zw_false) + 32768;
+	size_t member_size, total_bytes;
+	int threads = 0;
+	unsigned i, num_workers, num_jobs;
+
+	zw_u8* mem_block;
+	zw_gzip gzip;
+
+	if (!options || !options->stream.write)
+		return NULL;
+	member_size = options->member_size ? ZW_ROUND_UP(options->member_size, 16) : 1024 * 1024;
+
+#ifdef ZW__THREADS
+	threads = options->threads > 0 ? options->threads : zw__cpu_count();
+	if (threads > 256)
+		threads = 256;
+	if (threads < 2)
+		threads = 0; // a single worker would only add hand-offs
+#endif
+	num_workers = threads ? (unsigned)threads : 1;
+	num_jobs = threads ? 2 * (unsigned)threads : 1;
+
+	total_bytes = details_bytes + num_workers * (worker_bytes + state_bytes) + num_jobs * (job_bytes + member_size);
+	mem_block = (zw_u8*) ZW_MALLOC(total_bytes);
+	if (!mem_block)
+		return NULL;
+	memset(mem_block, 0, total_bytes);
+
+	gzip = (zw_gzip)mem_block;
+	gzip->stream = options->stream;
+	gzip->member_size = member_size;
+	mem_block += details_bytes;
+
+	gzip->workers = (zw__gzip_worker*)mem_block;
+	gzip->num_workers = num_workers;
+	mem_block += num_workers * worker_bytes;
+	for (i = 0; i < num_workers; ++i) {
+		zw__gzip_worker* worker = &gzip->workers[i];
+		mem_block = zw__deflate_init(&worker->state, mem_block, 32768, zw_false);
+		worker->state.out_full = &zw__gzip_out_full;
+		worker->state.owner = worker;
+		worker->state.check = zw__check_crc32;
+		worker->gzip = gzip;
+	}
+
+	gzip->jobs = (zw__gzip_job*)mem_block;
+	gzip->num_jobs = num_jobs;
+	mem_block += num_jobs * job_bytes;
+	for (i = 0; i < num_jobs; ++i) {
+		gzip->jobs[i].input = mem_block;
+		mem_block += member_size;
+	}
+
+#ifdef ZW__THREADS
+	if (threads) {
+		zw__mutex_init(&gzip->mutex);
+		zw__cond_init(&gzip->cond);
+		for (i = 0; i < num_workers; ++i) {
+			if (!zw__thread_start(&gzip->workers[i].thread, &zw__gzip_run, &gzip->workers[i]))
+				break;
+			gzip->num_threads++;
+		}
+		if (!gzip->num_threads) {
+			zw__cond_destroy(&gzip->cond);
+			zw__mutex_destroy(&gzip->mutex);
+		}
+	}
+#endif
+
+	return gzip;
+}
+
+zw_bool zw_gzip_write(zw_gzip gzip, const void* data, size_t data_len) {
+	if (!gzip || (!data && data_len) || gzip->stream.error)
+		return zw_false;
+
+	while (data_len > 0) {
+		zw__gzip_job* job = &gzip->jobs[gzip->filled % gzip->num_jobs];
+		size_t avail = gzip->member_size - job->input_size;
+		size_t batch = data_len < avail ? data_len : avail;
+
+		ZW_MEMMOVE(job->input + job->input_size, data, batch);
+		job->input_size += batch;
+		if (job->input_size == gzip->member_size)
+			zw__gzip_submit(gzip);
+		data_len -= batch;
+		data = (const zw_u8*)data + batch;
+	}
+
+	return gzip->stream.error ? zw_false : zw_true;
+}
+
+zw_bool zw_gzip_finish(zw_gzip gzip) {
+	zw_bool result;
+	unsigned i;
+
+	if (!gzip)
+		return zw_false;
+
+	// an empty input still becomes one (empty) member
+	if (gzip->jobs[gzip->filled % gzip->num_jobs].input_size > 0 || gzip->filled == 0)
+		zw__gzip_submit(gzip);
+	while (zw__gzip_write_oldest(gzip, zw_true))
+		;
+
+#ifdef ZW__THREADS
+	if (gzip->num_threads) {
+		zw__mutex_lock(&gzip->mutex);
+		gzip->done = zw_true;
+		zw__cond_broadcast(&gzip->cond);
+		zw__mutex_unlock(&gzip->mutex);
+		for (i = 0; i < gzip->num_threads; ++i)
+			zw__thread_join(gzip->workers[i].thread);
+		zw__cond_destroy(&gzip->cond);
+		zw__mutex_destroy(&gzip->mutex);
+	}
+#endif
+
+	for (i = 0; i < gzip->num_workers; ++i)
+		zw__free_chains(&gzip->workers[i].state);
+	for (i = 0; i < gzip->num_jobs; ++i)
+		zw__sbfree(&zw__default_allocator, gzip->jobs[i].output);
+
+	if (gzip->stream.close)
+		gzip->stream.close(&gzip->stream);
+	result = gzip->stream.error ? zw_false : zw_true;
+
+	ZW_FREE(gzip);
 
 	return result;
 }